@@ -24,373 +24,3894 @@
  */
 
 #include <apt-pkg/init.h>
+#include <apt-pkg/aptconfiguration.h>
 #include <apt-pkg/cachefile.h>
 #include <apt-pkg/cacheset.h>
 #include <apt-pkg/cmndline.h>
+#include <apt-pkg/pkgsystem.h>
+#include <apt-pkg/policy.h>
 #include <apt-pkg/version.h>
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <regex.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
 #include <string>
 #include <set>
+#include <map>
+#include <queue>
+#include <deque>
+#include <unordered_map>
 #include <vector>
-#include <array>
-#include <fstream>
-#include <iomanip>
 #include <algorithm>
-#include <stdexcept>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
 
 static pkgSourceList *list;
 static pkgPolicy *policy;
 
+/**
+ * \brief Output formats
+ */
+enum output_format {
+    /** Human-readable text */
+    FORMAT_TEXT,
+    /** One JSON object per line and package */
+    FORMAT_JSONL,
+    /** One line of tab-separated fields per package */
+    FORMAT_TSV,
+};
+
+/**
+ * \brief Names of the output formats, as used by --format
+ */
+static const char *format_names[] = {"text", "jsonl", "tsv", NULL};
+
+/**
+ * \brief The APT::Show-Versions options
+ *
+ * These are read once by read_options() after the command line has been
+ * parsed, so that the per-package code does not have to query the
+ * configuration tree.
+ */
+static struct Options {
+    bool brief;
+    bool upgrades_only;
+    bool all_versions;
+    bool no_hold;
+    bool regex_all;
+    unsigned int threads;
+    output_format format;
+    bool result_cache;
+    bool stats;
+    std::string since;
+    bool check;
+    bool security;
+    bool low_memory;
+    bool cache_read_only;
+    /** Seconds to wait for a read-only cache to become current */
+    unsigned int cache_wait;
+    std::string arch;
+    std::string section;
+    std::string origin;
+    /** Number of slowest packages to report, 0 for none */
+    unsigned int profile;
+    std::string export_snapshot;
+    std::string from_snapshot;
+    bool aggregate;
+} options;
+
+/**
+ * \brief Phases timed for --stats
+ */
+enum stats_phase {
+    PHASE_CACHE,
+    PHASE_POLICY,
+    PHASE_TABLES,
+    PHASE_SORT,
+    PHASE_PATTERNS,
+    PHASE_CANDIDATES,
+    PHASE_SCAN,
+    PHASE_WRITE,
+    PHASE_RESULT_CACHE,
+    PHASE_COUNT
+};
+
+/**
+ * \brief Names of the phases, as shown by --stats
+ */
+static const char *stats_phase_names[] = {
+    "open cache",
+    "sources and policy",
+    "build tables",
+    "sort groups",
+    "resolve patterns",
+    "candidate table",
+    "scan packages",
+    "write output",
+    "result cache",
+};
+
+/**
+ * \brief Timings and counters for --stats
+ *
+ * These are only updated if options.stats is set. The counters updated by
+ * worker threads are atomic, and only updated once per thread.
+ */
+static struct Stats {
+    /** Time spent in each phase, in nanoseconds */
+    uint64_t phase_ns[PHASE_COUNT];
+    /** Time spent in GetCandidateVer() outside of the candidate table */
+    uint64_t candidate_ns;
+    unsigned long candidate_lookups;
+    /** Calls of FindInCache() for the distribution table */
+    unsigned long index_lookups;
+    /** Package files whose distribution was found in the sources.list */
+    unsigned long files_resolved;
+    /** Package files falling back to their archive or codename */
+    unsigned long files_fallback;
+    std::atomic<unsigned long> packages_visited;
+    std::atomic<unsigned long> packages_shown;
+} stats;
+
+/**
+ * \brief Get the time of the monotonic clock, in nanoseconds
+ */
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/**
+ * \brief Adds the time until it is destroyed to a phase, for --stats
+ *
+ * Timers nest, as tables are built on first use in the middle of other
+ * phases. The time of a nested timer is only added to its own phase, so
+ * the phases add up to the time they cover.
+ */
+class PhaseTimer {
+    stats_phase phase;
+    uint64_t start;
+    /** Time spent in nested timers */
+    uint64_t nested;
+    PhaseTimer *parent;
+
+    /** The innermost timer running in this thread */
+    static thread_local PhaseTimer *active;
+
+public:
+    explicit PhaseTimer(stats_phase phase)
+        : phase(phase), start(0), nested(0), parent(NULL) {
+        if (unlikely(options.stats)) {
+            start = monotonic_ns();
+            parent = active;
+            active = this;
+        }
+    }
+
+    ~PhaseTimer() {
+        if (likely(!options.stats))
+            return;
+
+        uint64_t elapsed = monotonic_ns() - start;
+        stats.phase_ns[phase] += elapsed - nested;
+        if (parent != NULL)
+            parent->nested += elapsed;
+        active = parent;
+    }
+};
+
+thread_local PhaseTimer *PhaseTimer::active;
+
+/**
+ * \brief The cache file the source list and the policy are read from
+ *
+ * Both are only read on first use, by need_source_list() and need_policy(),
+ * so queries that can be answered from the package cache alone never parse
+ * the preferences.
+ */
+static pkgCacheFile *lazy_cachefile;
+
+/**
+ * \brief Whether reading the source list or the policy failed
+ *
+ * The server reopens the cache before the next query in that case, so the
+ * errors are reported again, and fixed files are picked up.
+ */
+static bool policy_incomplete;
+
+/**
+ * \brief Make sure the source list is available in \a list
+ *
+ * If the source list cannot be read, an empty one is used, and the errors
+ * are left pending, to be reported at the end of the run.
+ */
+static void need_source_list()
+{
+    static pkgSourceList empty;
+
+    if (likely(list != NULL))
+        return;
+
+    PhaseTimer timer(PHASE_POLICY);
+    bool failed = _error->PendingError();
+    list = lazy_cachefile->GetSourceList();
+    if (list == NULL)
+        list = &empty;
+    if (list == &empty || (!failed && _error->PendingError()))
+        policy_incomplete = true;
+}
+
+/**
+ * \brief Make sure the policy is available in \a policy
+ *
+ * If the preferences cannot be read, the default policy is used, and the
+ * errors are left pending, to be reported at the end of the run.
+ */
+static void need_policy()
+{
+    static std::unique_ptr<pkgPolicy> fallback;
+
+    if (likely(policy != NULL))
+        return;
+
+    PhaseTimer timer(PHASE_POLICY);
+    bool failed = _error->PendingError();
+    policy = lazy_cachefile->GetPolicy();
+    if (policy == NULL || (!failed && _error->PendingError()))
+        policy_incomplete = true;
+    if (policy == NULL) {
+        fallback.reset(new pkgPolicy(lazy_cachefile->GetPkgCache()));
+        fallback->InitDefaults();
+        policy = fallback.get();
+    }
+}
+
+/**
+ * \brief Set the output format option from its name
+ */
+static bool set_format(const std::string &format)
+{
+    for (size_t i = 0; format_names[i]; i++) {
+        if (format == format_names[i]) {
+            options.format = static_cast<output_format>(i);
+            return true;
+        }
+    }
+
+    return _error->Error("Unknown output format '%s'", format.c_str());
+}
+
+/**
+ * \brief Fill the global options from the configuration
+ */
+static void read_options()
+{
+    options.brief = _config->FindB("APT::Show-Versions::Brief");
+    options.upgrades_only = _config->FindB("APT::Show-Versions::Upgrades-Only");
+    options.all_versions = _config->FindB("APT::Show-Versions::All-Versions");
+    options.no_hold = _config->FindB("APT::Show-Versions::No-Hold");
+    options.regex_all = _config->FindB("APT::Show-Versions::Regex-All");
+    options.threads = std::max(_config->FindI("APT::Show-Versions::Threads", 1), 0);
+    if (options.threads == 0)
+        options.threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+    /* Threads buffer the output of their whole share of the packages */
+    options.low_memory = _config->FindB("APT::Show-Versions::Low-Memory");
+    if (options.low_memory)
+        options.threads = 1;
+
+    options.result_cache = _config->FindB("APT::Show-Versions::Result-Cache");
+    options.stats = _config->FindB("APT::Show-Versions::Stats");
+    options.since = _config->Find("APT::Show-Versions::Since");
+    options.check = _config->FindB("APT::Show-Versions::Check");
+    options.security = _config->FindB("APT::Show-Versions::Security");
+    options.cache_read_only = _config->FindB("APT::Show-Versions::Cache-Read-Only");
+    options.cache_wait = std::max(_config->FindI("APT::Show-Versions::Cache-Wait", 0), 0);
+    options.arch = _config->Find("APT::Show-Versions::Arch");
+    options.section = _config->Find("APT::Show-Versions::Section");
+    options.origin = _config->Find("APT::Show-Versions::Origin");
+    options.profile = std::max(_config->FindI("APT::Show-Versions::Profile-Packages", 0), 0);
+    options.export_snapshot = _config->Find("APT::Show-Versions::Export-Snapshot");
+    options.from_snapshot = _config->Find("APT::Show-Versions::From-Snapshot");
+    options.aggregate = _config->FindB("APT::Show-Versions::Aggregate");
+
+    set_format(_config->Find("APT::Show-Versions::Format", "text"));
+}
+
+/**
+ * \brief Append-only output buffer
+ *
+ * Output is collected in a large chunk which is written to the file
+ * descriptor with write(2) once it fills up, and when the buffer is flushed
+ * or destroyed. A buffer without a file descriptor grows instead.
+ */
+class OutputBuffer {
+    std::vector<char> data;
+    size_t used;
+    int fd;
+    /** Bytes written to the file descriptor so far */
+    size_t total;
+
+    void make_room(size_t len) {
+        if (fd >= 0)
+            flush();
+        if (used + len > data.size())
+            data.resize(std::max(2 * data.size(), used + len));
+    }
+
+    bool write_fd(const char *s, size_t len) {
+        PhaseTimer timer(PHASE_WRITE);
+
+        while (len > 0) {
+            ssize_t res = ::write(fd, s, len);
+            if (res < 0 && errno == EINTR)
+                continue;
+            if (res < 0)
+                return _error->Errno("write", "Could not write output");
+            s += res;
+            len -= res;
+            total += res;
+        }
+        return true;
+    }
+
+public:
+    explicit OutputBuffer(int fd = -1, size_t size = 64 * 1024)
+        : data(size), used(0), fd(fd), total(0) {
+    }
+
+    ~OutputBuffer() {
+        flush();
+    }
+
+    void write(const char *s, size_t len) {
+        if (unlikely(used + len > data.size())) {
+            /* Large blocks are passed through without copying them */
+            if (fd >= 0 && len >= data.size()) {
+                flush();
+                write_fd(s, len);
+                return;
+            }
+            make_room(len);
+        }
+        memcpy(&data[used], s, len);
+        used += len;
+    }
+
+    void write(const char *s) {
+        write(s, strlen(s));
+    }
+
+    void write(const std::string &s) {
+        write(s.data(), s.size());
+    }
+
+    /** \brief Append the contents of another buffer */
+    void write(const OutputBuffer &other) {
+        write(other.begin(), other.size());
+    }
+
+    /** \brief The buffered data */
+    const char *begin() const {
+        return data.data();
+    }
+
+    /** \brief The size of the buffered data */
+    size_t size() const {
+        return used;
+    }
+
+    /** \brief The number of bytes written to the file descriptor */
+    size_t written() const {
+        return total;
+    }
+
+    void put(char c) {
+        if (unlikely(used == data.size()))
+            make_room(1);
+        data[used++] = c;
+    }
+
+    /** \brief Append \a len spaces */
+    void pad(size_t len) {
+        if (unlikely(used + len > data.size()))
+            make_room(len);
+        memset(&data[used], ' ', len);
+        used += len;
+    }
+
+    /** \brief Write out the buffered data, if there is a file descriptor */
+    bool flush() {
+        if (fd < 0)
+            return true;
+
+        bool res = write_fd(data.data(), used);
+        used = 0;
+        return res;
+    }
+};
+
+
+/**
+ * \brief The official suites
+ *
+ * The first element is obviously not an official suite, it is just added to
+ * make code writing easier.
+ */
+static const char *official_suites[] = {
+    "",
+    "oldstable",
+    "stable",
+    "proposed-updates",
+    "stable-updates",
+    "testing",
+    "testing-proposed-updates",
+    "testing-updates",
+    "unstable",
+    "experimental",
+    NULL
+};
+
+/**
+ * \brief ID of an interned string
+ */
+typedef uint16_t string_id;
+
+/**
+ * \brief Interned strings, indexed by their ID
+ *
+ * The archives, codenames and sites of all package files, the official
+ * suites and the distributions resolved for the files are interned once,
+ * so that the per-package code compares and stores IDs, and only turns
+ * them into strings for output. ID 0 is the empty string. A deque is used
+ * so that references to the strings stay valid when more are added.
+ */
+static std::deque<std::string> interned;
+
+/**
+ * \brief IDs of the interned strings
+ */
+static std::unordered_map<std::string, string_id> interned_ids;
+
+/**
+ * \brief Intern a string
+ */
+static string_id intern(const std::string &s)
+{
+    auto it = interned_ids.find(s);
+    if (it != interned_ids.end())
+        return it->second;
+    /* Cannot happen with any realistic number of package files */
+    if (interned.size() > UINT16_MAX)
+        return 0;
+
+    interned.push_back(s);
+    interned_ids[s] = interned.size() - 1;
+    return interned.size() - 1;
+}
+
+/**
+ * \brief Intern a string from the cache, which may be NULL
+ */
+static string_id intern(const char *s)
+{
+    return s == NULL ? 0 : intern(std::string(s));
+}
+
+/**
+ * \brief Archives, codenames and sites of package files, indexed by PkgFile->ID
+ */
+static std::vector<string_id> file_archives, file_codenames, file_sites;
+
+/**
+ * \brief Bits in file_flags
+ */
+enum file_flag {
+    /** The file is from a security archive */
+    FILE_SECURITY = 1 << 0,
+    /** The file is from the origin given with --origin */
+    FILE_ORIGIN = 1 << 1,
+    /** The distribution of the file was not found in the sources.list */
+    FILE_FALLBACK = 1 << 2,
+};
+
+/**
+ * \brief Flags of package files, indexed by PkgFile->ID
+ *
+ * The origin bit is set by build_filter_table(), and the others by
+ * build_distribution_table(), so that classifying a file is a bit test.
+ */
+static std::vector<unsigned char> file_flags;
+
+/**
+ * \brief IDs of the official suites, indexed like official_suites
+ */
+static std::vector<string_id> official_suite_ids;
+
+/**
+ * \brief Intern the strings of all package files and the official suites
+ *
+ * Strings interned for an earlier cache are kept, so that reloading the
+ * cache or showing several roots with the same sources finds them again.
+ */
+static void build_string_table(pkgCache *cache)
+{
+    size_t count = cache->HeaderP->PackageFileCount;
+
+    intern(std::string());
+
+    file_archives.assign(count, 0);
+    file_codenames.assign(count, 0);
+    file_sites.assign(count, 0);
+    file_flags.assign(count, 0);
+    for (auto file = cache->FileBegin(); file != cache->FileEnd(); file++) {
+        if (file->Archive)
+            file_archives[file->ID] = intern(file.Archive());
+        if (file->Codename)
+            file_codenames[file->ID] = intern(file.Codename());
+        if (file->Site)
+            file_sites[file->ID] = intern(file.Site());
+    }
+
+    official_suite_ids.clear();
+    for (size_t s = 0; official_suites[s]; s++)
+        official_suite_ids.push_back(intern(official_suites[s]));
+}
+
+/**
+ * \brief Offsets of the strings accepted by --arch and --section
+ *
+ * Architectures and sections are stored as unique strings in the cache, so
+ * checking a package against them compares offsets and never looks at the
+ * strings themselves.
+ */
+static std::vector<map_ptrloc> filter_archs, filter_sections;
+
+/**
+ * \brief Check whether a section is the one given with --section
+ *
+ * A section like contrib/kernel is accepted for kernel, too.
+ */
+static bool is_filter_section(const char *section)
+{
+    size_t len = strlen(section);
+    size_t wanted = options.section.size();
+
+    if (len < wanted || options.section.compare(0, wanted, section + len - wanted) != 0)
+        return false;
+    return len == wanted || section[len - wanted - 1] == '/';
+}
+
+/**
+ * \brief Look up the strings of the --arch, --section and --origin filters
+ *
+ * This is cheap enough to be done again for each query to the server.
+ *
+ * The list of unique strings in the cache is short, as it only holds
+ * things like architectures, sections and priorities. Packages with
+ * Architecture: all get the native architecture from the header, which is
+ * not in that list, so it is added for the native architecture.
+ */
+static void build_filter_table(pkgCache *cache)
+{
+    filter_archs.clear();
+    filter_sections.clear();
+
+    for (auto file = cache->FileBegin(); file != cache->FileEnd(); file++) {
+        file_flags[file->ID] &= ~FILE_ORIGIN;
+        if (file->Origin && !options.origin.empty() && options.origin == file.Origin())
+            file_flags[file->ID] |= FILE_ORIGIN;
+    }
+
+    if (options.arch.empty() && options.section.empty())
+        return;
+
+    if (!options.arch.empty() && options.arch == cache->NativeArch())
+        filter_archs.push_back(cache->HeaderP->Architecture);
+
+    for (auto item = cache->StringItemP + cache->HeaderP->StringList;
+         item != cache->StringItemP; item = cache->StringItemP + item->NextItem) {
+        const char *s = cache->StrP + item->String;
+        if (!options.arch.empty() && options.arch == s)
+            filter_archs.push_back(item->String);
+        if (!options.section.empty() && is_filter_section(s))
+            filter_sections.push_back(item->String);
+    }
+}
+
+/**
+ * \brief Check whether a package passes the --arch, --section and --origin filters
+ *
+ * This only looks at the package and the files of its versions, so it is
+ * done before the candidate is determined.
+ */
+static bool is_selected(const pkgCache::PkgIterator &p)
+{
+    if (!options.arch.empty() &&
+        std::find(filter_archs.begin(), filter_archs.end(), p->Arch) == filter_archs.end())
+        return false;
+    if (!options.section.empty() &&
+        std::find(filter_sections.begin(), filter_sections.end(), p->Section) == filter_sections.end())
+        return false;
+    if (!options.origin.empty()) {
+        for (auto ver = p.VersionList(); ver.IsGood(); ver++)
+            for (auto vf = ver.FileList(); vf.IsGood(); vf++)
+                if (file_flags[vf.File()->ID] & FILE_ORIGIN)
+                    return true;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * \brief Distributions of package files, indexed by PkgFile->ID
+ *
+ * This is filled in by build_distribution_table(), so looking up a
+ * distribution is a plain index operation.
+ */
+static std::vector<string_id> distributions;
+
+/**
+ * \brief Check whether an archive or codename names a security suite
+ */
+static bool is_security_suite(const std::string &suite)
+{
+    static const std::string suffix = "-security";
+
+    return suite.size() > suffix.size() &&
+           suite.compare(suite.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+/**
+ * \brief Resolve the distributions of all package files in one pass
+ *
+ * Each index file of each sources.list entry is looked up in the cache
+ * exactly once, as a lookup currently involves several stat() syscalls
+ * when calling FindInCache(). A package file gets the distribution of the
+ * first sources.list entry listing it whose distribution matches the file's
+ * archive or codename. All other files fall back to their archive or
+ * codename.
+ *
+ * Files are classified as security files if they are listed by an entry
+ * for a distribution like stable/updates, if their label contains
+ * "Security", or if their archive or codename ends in -security.
+ */
+static void build_distribution_table(pkgCache *cache)
+{
+    std::vector<bool> resolved(cache->HeaderP->PackageFileCount, false);
+
+    distributions.assign(cache->HeaderP->PackageFileCount, 0);
+    need_source_list();
+    for (auto i = list->begin(); i != list->end(); ++i) {
+        std::string distro = (**i).GetDist();
+        /* For stable/updates and similar, we want to display stable */
+        size_t subdistro = distro.find_first_of('/');
+        bool security = subdistro != std::string::npos &&
+                        distro.compare(subdistro, std::string::npos, "/updates") == 0;
+        if (subdistro != std::string::npos)
+            distro.erase(subdistro);
+        string_id distro_id = intern(distro);
+
+        vector<pkgIndexFile *> *indexes = (*i)->GetIndexFiles();
+        for (auto filep = indexes->begin(); filep != indexes->end(); ++filep) {
+            auto file = (*filep)->FindInCache(*cache);
+            stats.index_lookups++;
+            if (!file.IsGood())
+                continue;
+            if (security)
+                file_flags[file->ID] |= FILE_SECURITY;
+            if (resolved[file->ID])
+                continue;
+
+            if ((file_archives[file->ID] != 0 && distro_id == file_archives[file->ID]) ||
+                (file_codenames[file->ID] != 0 && distro_id == file_codenames[file->ID])) {
+                distributions[file->ID] = distro_id;
+                resolved[file->ID] = true;
+                stats.files_resolved++;
+            }
+        }
+    }
+
+    for (auto file = cache->FileBegin(); file != cache->FileEnd(); file++) {
+        if ((file->Label && strstr(file.Label(), "Security") != NULL) ||
+            is_security_suite(interned[file_archives[file->ID]]) ||
+            is_security_suite(interned[file_codenames[file->ID]]))
+            file_flags[file->ID] |= FILE_SECURITY;
+
+        if (resolved[file->ID])
+            continue;
+        file_flags[file->ID] |= FILE_FALLBACK;
+        stats.files_fallback++;
+        if (file_archives[file->ID] != 0)
+            distributions[file->ID] = file_archives[file->ID];
+        else
+            distributions[file->ID] = file_codenames[file->ID];
+    }
+}
+
+/**
+ * \brief Make sure the distribution table is built
+ */
+static void need_distribution_table(pkgCache *cache)
+{
+    if (likely(!distributions.empty()))
+        return;
+
+    need_source_list();
+    PhaseTimer timer(PHASE_TABLES);
+    build_distribution_table(cache);
+}
+
+/**
+ * \brief Candidate versions of installed packages, indexed by Package->ID
+ *
+ * This is only filled in for threaded runs, by build_candidate_table() before
+ * the workers are started, so that they never call into the policy. It is
+ * cleared once they are done, as it may only hold the packages the scan
+ * looks at.
+ */
+static std::vector<pkgCache::Version *> candidates;
+
+/**
+ * \brief Number of packages a thread takes at once in build_candidate_table()
+ */
+static const size_t candidate_chunk = 256;
+
+/**
+ * \brief Look up the candidate versions of a share of the installed packages
+ *
+ * \param next The index of the next chunk of packages nobody took yet
+ */
+static void evaluate_candidates(pkgCache *cache, pkgPolicy *pol,
+                                const std::vector<pkgCache::Package *> &installed,
+                                std::atomic<size_t> &next)
+{
+    for (;;) {
+        size_t begin = next.fetch_add(candidate_chunk);
+        if (begin >= installed.size())
+            return;
+
+        size_t end = std::min(begin + candidate_chunk, installed.size());
+        for (size_t i = begin; i < end; i++)
+            candidates[installed[i]->ID] =
+                pol->GetCandidateVer(pkgCache::PkgIterator(*cache, installed[i]));
+    }
+}
+
+/**
+ * \brief Look up the candidate versions of all installed packages
+ *
+ * This uses all threads requested with -j. The installed packages are split
+ * into small chunks, which the threads take until none are left, so that a
+ * thread running into expensive packages does not hold up the others. Each
+ * additional thread gets its own policy, read from the same preferences,
+ * so the policy is never shared between threads.
+ *
+ * \param wanted If given, only packages passing this check are looked up
+ */
+static void build_candidate_table(pkgCache *cache,
+                                  bool (*wanted)(const pkgCache::PkgIterator &) = NULL)
+{
+    PhaseTimer timer(PHASE_CANDIDATES);
+    std::vector<pkgCache::Package *> installed;
+    std::atomic<size_t> next(0);
+
+    candidates.assign(cache->HeaderP->PackageCount, NULL);
+
+    for (auto p = cache->PkgBegin(); !p.end(); p++)
+        if (p->CurrentVer != 0 && (wanted == NULL || wanted(p)))
+            installed.push_back(p);
+
+    size_t nthreads = std::min<size_t>(options.threads,
+                                       installed.size() / candidate_chunk + 1);
+    std::vector<std::unique_ptr<pkgPolicy> > policies;
+
+    need_policy();
+    _error->PushToStack();
+    for (size_t i = 1; i < nthreads; i++) {
+        policies.push_back(std::unique_ptr<pkgPolicy>(new pkgPolicy(cache)));
+        if (!ReadPinFile(*policies.back()) || !ReadPinDir(*policies.back())) {
+            policies.clear();
+            break;
+        }
+    }
+    /* The main policy read the same files, so this is not expected to fail;
+     * if it does, just evaluate everything in this thread. */
+    if (policies.empty())
+        _error->RevertToStack();
+    else
+        _error->MergeWithStack();
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < policies.size(); i++)
+        workers.push_back(std::thread(evaluate_candidates, cache, policies[i].get(),
+                                      std::cref(installed), std::ref(next)));
+
+    evaluate_candidates(cache, policy, installed, next);
+
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+}
+
+/**
+ * \brief Get the candidate version of a package
+ */
+static pkgCache::VerIterator candidate_version(const pkgCache::PkgIterator &p)
+{
+    if (!candidates.empty() && p->CurrentVer != 0)
+        return pkgCache::VerIterator(*p.Cache(), candidates[p->ID]);
+
+    need_policy();
+    if (likely(!options.stats))
+        return policy->GetCandidateVer(p);
+
+    uint64_t start = monotonic_ns();
+    pkgCache::VerIterator ver = policy->GetCandidateVer(p);
+    stats.candidate_ns += monotonic_ns() - start;
+    stats.candidate_lookups++;
+    return ver;
+}
+
+/**
+ * \brief Find the distribution of a package file
+ */
+static string_id find_distribution(pkgCache::PkgFileIterator file)
+{
+    need_distribution_table(file.Cache());
+    return distributions[file->ID];
+}
+
+/**
+ * \brief Find the name of the distribution of a package file
+ */
+static const std::string& find_distribution_name(pkgCache::PkgFileIterator file)
+{
+    return interned[find_distribution(file)];
+}
+
+/**
+ * \brief Check whether the name of a package is displayed with its architecture
+ *
+ * Like FullName(true), this compares the strings: the native architecture in
+ * the header is not necessarily the same string as the one of the packages.
+ */
+static bool is_qualified(const pkgCache::PkgIterator &p)
+{
+    return strcmp(p.Arch(), p.Cache()->NativeArch()) != 0 && strcmp(p.Arch(), "all") != 0;
+}
+
+/**
+ * \brief Write the name of a package
+ *
+ * This is the same as FullName(true), that is, the name is qualified with
+ * the architecture if that is not the native one, but it writes the strings
+ * from the cache directly instead of concatenating them.
+ */
+static void write_full_name(OutputBuffer &out, const pkgCache::PkgIterator &p)
+{
+    out.write(p.Name());
+    if (is_qualified(p)) {
+        out.put(':');
+        out.write(p.Arch());
+    }
+}
+
+/**
+ * \brief Priorities of package files, indexed by PkgFile->ID
+ *
+ * The priorities are fixed for a run, so they are copied out of the policy
+ * once by build_priority_table().
+ */
+static std::vector<signed short> priorities;
+
+/**
+ * \brief The APT::Policy::StatusOverride option of the policy
+ */
+static bool status_override;
+
+/**
+ * \brief Look up the priorities of all package files
+ */
+static void build_priority_table(pkgCache *cache)
+{
+    priorities.assign(cache->HeaderP->PackageFileCount, 0);
+    status_override = _config->FindB("APT::Policy::StatusOverride", false);
+
+    need_policy();
+
+    for (auto file = cache->FileBegin(); file != cache->FileEnd(); file++)
+        priorities[file->ID] = policy->GetPriority(file);
+}
+
+/**
+ * \brief Make sure the priority table is built
+ *
+ * This implies need_policy().
+ */
+static void need_priority_table(pkgCache *cache)
+{
+    if (likely(!priorities.empty()))
+        return;
+
+    need_policy();
+    PhaseTimer timer(PHASE_TABLES);
+    build_priority_table(cache);
+}
+
+/**
+ * \brief Find the distribution to display for a given candidate
+ *
+ * If the candidate exists in multiple distributions, the distribution with
+ * the highest priority is chosen; of several with the same priority, the
+ * first one.
+ *
+ * \param c The candidate to take the distribution info from
+ * \return The ID of the distribution, 0 if no distribution is known
+ */
+static string_id my_distribution(pkgCache::VerIterator c)
+{
+    string_id my = 0;
+    int prio = 0;
+
+    need_priority_table(c.Cache());
+
+    for (auto vf = c.FileList(); vf.IsGood(); vf++) {
+        auto file = vf.File();
+        if (file->Flags & pkgCache::Flag::NotSource)
+            continue;
+
+        int this_prio = priorities[file->ID];
+        if (my != 0 && prio >= this_prio)
+            continue;
+
+        string_id distro = find_distribution(file);
+        if (distro != 0) {
+            my = distro;
+            prio = this_prio;
+        }
+    }
+    return my;
+}
+
+/**
+ * \brief Returns a dpkg Status line, for displaying purposes
+ */
+static void describe_state(OutputBuffer &out, const pkgCache::PkgIterator &pkg)
+{
+    static const char *selections[] = {"unknown", "install", "hold",
+                                       "deinstall", "purge"};
+    static const char *installs[] = {"ok", "reinstreq", "hold",
+                                     "hold-reinstreq"};
+    static const char *currents[] = {"not-installed", "unpacked",
+                                     "half-configured", "INVALID",
+                                     "half-installed", "config-files",
+                                     "installed", "triggers-awaited",
+                                     "triggers-pending"};
+
+    assert(pkg->SelectedState < sizeof(selections) / sizeof(selections[0]));
+    assert(pkg->InstState < sizeof(installs) / sizeof(installs[0]));
+    assert(pkg->CurrentState < sizeof(currents) / sizeof(currents[0]));
+
+    out.put(' ');
+    out.write(selections[pkg->SelectedState]);
+    out.put(' ');
+    out.write(installs[pkg->InstState]);
+    out.put(' ');
+    out.write(currents[pkg->CurrentState]);
+}
+
+/**
+ * \brief Possible upgrade states
+ */
+enum upgrade_state {
+    /** The package in question is not installed */
+    UPGRADE_NOT_INSTALLED,
+    /** The package is not available anymore */
+    UPGRADE_NOT_AVAIL,
+    /** The package is up-to-date */
+    UPGRADE_UPTODATE,
+    /** The installed version is not available anymore, but a downgrade */
+    UPGRADE_DOWNGRADE,
+    /** An upgrade can be performed automatically */
+    UPGRADE_AUTOMATIC,
+    /** A manual upgrade can be performed */
+    UPGRADE_MANUAL,
+};
+
+/**
+ * \brief Names of the upgrade states in machine-readable output
+ */
+static const char *upgrade_state_names[] = {
+    "not-installed",
+    "not-available",
+    "uptodate",
+    "downgrade",
+    "upgradeable",
+    "manually-upgradeable",
+};
+
+/**
+ * \brief Upgrade information about a single package
+ *
+ * This is determined once per package by determine_upgradeability() and then
+ * used for filtering, displaying and the exit code.
+ */
+struct UpgradeInfo {
+    pkgCache::PkgIterator pkg;
+    upgrade_state state;
+    /** The installed version */
+    pkgCache::VerIterator current;
+    /** The candidate version, only looked up for installed packages that are
+     * still available */
+    pkgCache::VerIterator candidate;
+    /** The newest version */
+    pkgCache::VerIterator newest;
+};
+
+/**
+ * \brief Determine the upgrade state of a package
+ */
+static UpgradeInfo determine_upgradeability(const pkgCache::PkgIterator &p)
+{
+    UpgradeInfo info;
+
+    info.pkg = p;
+    info.current = p.CurrentVer();
+    info.newest = p.VersionList();
+
+    if (info.current.end()) {
+        info.state = UPGRADE_NOT_INSTALLED;
+        return info;
+    } else if (info.newest->NextVer == 0 && info.current.FileList()->NextFile == 0) {
+        info.state = UPGRADE_NOT_AVAIL;
+        return info;
+    }
+
+    info.candidate = candidate_version(p);
+
+    if (info.candidate->ID != info.current->ID)
+        info.state = UPGRADE_AUTOMATIC;
+    else if (info.current.FileList()->NextFile != 0)
+        info.state = UPGRADE_UPTODATE;
+    else if (info.newest.IsGood() && info.newest->ID != info.current->ID)
+        info.state = UPGRADE_MANUAL;
+    else if (info.current->NextVer != 0)
+        info.state = UPGRADE_DOWNGRADE;
+    else
+        __builtin_trap();
+
+    return info;
+}
+
+/**
+ * \brief Cheap pre-filter for -u
+ *
+ * This rejects packages that cannot be upgradeable without asking the policy
+ * for the candidate: packages that are not installed or only available from
+ * the status file, and packages whose installed version is the newest one
+ * and is not pinned away from. For the latter, the policy always picks the
+ * installed version unless the package is pinned, one of the files of the
+ * installed version has a priority of at least 1000, or
+ * APT::Policy::StatusOverride is set.
+ *
+ * \return false if the package is certainly not upgradeable
+ */
+static bool may_be_upgradeable(const pkgCache::PkgIterator &p)
+{
+    pkgCache::VerIterator current = p.CurrentVer();
+    pkgCache::VerIterator newest = p.VersionList();
+
+    if (current.end())
+        return false;
+    if (newest->NextVer == 0 && current.FileList()->NextFile == 0)
+        return false;
+
+    need_priority_table(p.Cache());
+    if (newest->ID != current->ID || status_override || policy->GetPriority(p) != 0)
+        return true;
+
+    for (auto vf = current.FileList(); vf.IsGood(); vf++)
+        if (priorities[vf.File()->ID] >= 1000)
+            return true;
+
+    return false;
+}
+
+/**
+ * \brief Enable ordering for packages.
+ *
+ * We use that operator overload to have our APT::PackageSet instance
+ * sorted.
+ */
+static bool operator <(const pkgCache::PkgIterator &a,
+                       const pkgCache::PkgIterator &b)
+{
+    int value = strcmp(a.Name(), b.Name());
+
+    if (unlikely(value == 0))
+        value = strcmp(a.Arch(), b.Arch());
+
+    return value < 0;
+}
+
+/**
+ * \brief Official suite of each package file, indexed by PkgFile->ID
+ *
+ * This is an index into official_suites, 0 meaning that the file does not
+ * belong to an official suite.
+ */
+static std::vector<unsigned char> file_suites;
+
+/**
+ * \brief Bitmap of the official suites which are present in the cache
+ */
+static unsigned int suites_in_cache;
+
+/**
+ * \brief Determine the official suites of all package files
+ *
+ * This fills in file_suites and suites_in_cache, so that --allversions can
+ * compare suites as integers.
+ */
+static void build_suite_table(pkgCache *cache)
+{
+    file_suites.assign(cache->HeaderP->PackageFileCount, 0);
+    suites_in_cache = 0;
+
+    for (auto f = cache->FileBegin(); f != cache->FileEnd(); f++) {
+        if (file_archives[f->ID] == 0)
+            continue;
+
+        for (size_t s = 1; official_suites[s]; s++) {
+            if (official_suite_ids[s] == file_archives[f->ID]) {
+                file_suites[f->ID] = s;
+                suites_in_cache |= 1u << s;
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * \brief Write a column of the --allversions table
+ *
+ * \param width The width of the column, including the separating space
+ */
+static void write_column(OutputBuffer &out, const char *s, size_t len, size_t width)
+{
+    out.write(s, len);
+    out.pad(width - len);
+}
+
+/**
+ * \brief Implementation of parts of the --allversions option
+ *
+ * The table is written in two passes over the files of the package's
+ * versions, straight from the strings in the cache and the distribution
+ * table: the first pass determines the column widths, the second one writes
+ * the rows. Nothing is allocated, whatever the number of versions.
+ */
+static void show_all_versions(OutputBuffer &out, const pkgCache::PkgIterator &pkg)
+{
+    const char *name = pkg.Name();
+    const char *arch = is_qualified(pkg) ? pkg.Arch() : NULL;
+    size_t name_len = strlen(name);
+    size_t ver_width = 0, distro_width = 0, site_width = 0;
+
+    /* All suites of the files in the cache are shown, so every file gets a
+     * row, except for the ones which are not a source */
+    for (auto ver = pkg.VersionList(); ver.IsGood(); ver++) {
+        size_t ver_len = strlen(ver.VerStr());
+
+        for (auto vf = ver.FileList(); vf.IsGood(); vf++) {
+            if (vf.File()->Flags & pkgCache::Flag::NotSource)
+                continue;
+
+            ver_width = std::max(ver_width, ver_len + 1);
+            distro_width = std::max(distro_width, find_distribution_name(vf.File()).size() + 1);
+            site_width = std::max(site_width, interned[file_sites[vf.File()->ID]].size());
+        }
+    }
+
+    if (pkg->CurrentVer) {
+        write_full_name(out, pkg);
+        out.put(' ');
+        out.write(pkg.CurrentVer().VerStr());
+        describe_state(out, pkg);
+        out.put('\n');
+    } else {
+        out.write("Not installed\n");
+    }
+
+    for (unsigned int release = 0; official_suites[release]; release++) {
+        if (release != 0 && !(suites_in_cache & (1u << release)))
+            continue;
+
+        bool found = false;
+        for (auto ver = pkg.VersionList(); ver.IsGood(); ver++) {
+            for (auto vf = ver.FileList(); vf.IsGood(); vf++) {
+                if (vf.File()->Flags & pkgCache::Flag::NotSource)
+                    continue;
+
+                if (file_suites[vf.File()->ID] != release)
+                    continue;
+
+                found = true;
+
+                const std::string &distro = find_distribution_name(vf.File());
+                const std::string &site = interned[file_sites[vf.File()->ID]];
+
+                out.write(name, name_len);
+                if (arch) {
+                    out.put(':');
+                    out.write(arch);
+                }
+                out.put(' ');
+                write_column(out, ver.VerStr(), strlen(ver.VerStr()), ver_width);
+                write_column(out, distro.data(), distro.size(), distro_width);
+                write_column(out, site.data(), site.size(), site_width);
+                out.put('\n');
+            }
+        }
+
+        if (!found && release != 0) {
+            out.write("No ");
+            out.write(official_suites[release]);
+            out.write(" version\n");
+        }
+    }
+}
+
+/**
+ * \brief Write a string as a JSON string literal
+ */
+static void write_json_string(OutputBuffer &out, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    out.put('"');
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            out.put('\\');
+            out.put(c);
+        } else if (c < 0x20) {
+            out.write("\\u00", 4);
+            out.put(hex[c >> 4]);
+            out.put(hex[c & 0xf]);
+        } else {
+            out.put(c);
+        }
+    }
+    out.put('"');
+}
+
+/**
+ * \brief Write a single field of a machine-readable record
+ *
+ * For JSON Lines, a NULL value is written as null; for TSV, as an empty
+ * field.
+ */
+static void write_field(OutputBuffer &out, bool first, const char *key, const char *value)
+{
+    if (options.format == FORMAT_JSONL) {
+        out.write(first ? "{\"" : ",\"");
+        out.write(key);
+        out.write("\":");
+        if (value == NULL)
+            out.write("null");
+        else
+            write_json_string(out, value);
+    } else {
+        if (!first)
+            out.put('\t');
+        if (value != NULL)
+            out.write(value);
+    }
+}
+
+/**
+ * \brief The displayable result for a single package
+ *
+ * This is what is shown for a package, independent of the options. The
+ * strings point into the cache or the distribution table, or into a loaded
+ * result cache. Versions and distribution are NULL if not known.
+ */
+struct Record {
+    const char *name;
+    const char *arch;
+    /** Whether the name is displayed qualified with the architecture */
+    bool qualified;
+    bool held;
+    upgrade_state state;
+    const char *installed;
+    /** The version the package can be upgraded to, or the candidate */
+    const char *available;
+    /** The distribution the available version comes from */
+    const char *distribution;
+};
+
+/**
+ * \brief Build the record for a package
+ */
+static Record make_record(const UpgradeInfo &info)
+{
+    Record r;
+
+    r.name = info.pkg.Name();
+    r.arch = info.pkg.Arch();
+    r.qualified = is_qualified(info.pkg);
+    r.held = info.pkg->SelectedState == pkgCache::State::Hold;
+    r.state = info.state;
+    r.installed = NULL;
+    r.available = NULL;
+    r.distribution = NULL;
+
+    if (info.state != UPGRADE_NOT_INSTALLED)
+        r.installed = info.current.VerStr();
+    if (info.state >= UPGRADE_UPTODATE) {
+        auto target = info.state == UPGRADE_MANUAL ? info.newest : info.candidate;
+        string_id distro = my_distribution(target);
+        r.available = target.VerStr();
+        if (distro != 0)
+            r.distribution = interned[distro].c_str();
+    }
+
+    return r;
+}
+
+/**
+ * \brief Check whether a package passes the -n and -u filters
+ */
+static bool is_wanted(bool held, upgrade_state state)
+{
+    if (held && options.no_hold)
+        return false;
+    if (state < UPGRADE_AUTOMATIC && options.upgrades_only)
+        return false;
+    return true;
+}
+
+/**
+ * \brief Check whether a package can be upgraded from a security archive
+ *
+ * This is the case if the version it can be upgraded to is in a package
+ * file classified as a security file by build_distribution_table().
+ */
+static bool is_security_upgrade(const UpgradeInfo &info)
+{
+    if (info.state < UPGRADE_AUTOMATIC)
+        return false;
+
+    auto target = info.state == UPGRADE_MANUAL ? info.newest : info.candidate;
+
+    need_distribution_table(target.Cache());
+    for (auto vf = target.FileList(); vf.IsGood(); vf++)
+        if (file_flags[vf.File()->ID] & FILE_SECURITY)
+            return true;
+    return false;
+}
+
+/**
+ * \brief The root directory being shown with --root-list, or NULL
+ */
+static const char *record_root;
+
+/**
+ * \brief Write the machine-readable form of a record
+ *
+ * The fields are the package name, architecture, upgrade state, installed
+ * version, the version it can be upgraded to (or the candidate) and the
+ * distribution that version comes from. With --root-list, the root
+ * directory comes first.
+ */
+static void write_machine_record(OutputBuffer &out, const Record &r)
+{
+    if (record_root != NULL)
+        write_field(out, true, "root", record_root);
+    write_field(out, record_root == NULL, "package", r.name);
+    write_field(out, false, "arch", r.arch);
+    write_field(out, false, "state", upgrade_state_names[r.state]);
+    write_field(out, false, "installed", r.installed);
+    write_field(out, false, "available", r.available);
+    write_field(out, false, "distribution", r.distribution);
+    if (options.format == FORMAT_JSONL)
+        out.put('}');
+    out.put('\n');
+}
+
+/**
+ * \brief Write the name of a record, qualified with the architecture if needed
+ */
+static void write_record_name(OutputBuffer &out, const Record &r)
+{
+    out.write(r.name);
+    if (r.qualified) {
+        out.put(':');
+        out.write(r.arch);
+    }
+}
+
+/**
+ * \brief Shows the upgrade information line of a record
+ */
+static void show_record(OutputBuffer &out, const Record &r)
+{
+    if (options.format != FORMAT_TEXT) {
+        write_machine_record(out, r);
+        return;
+    }
+
+    if (r.state == UPGRADE_NOT_INSTALLED) {
+        write_record_name(out, r);
+        out.write(" not installed\n");
+        return;
+    } else if (r.state == UPGRADE_NOT_AVAIL) {
+        write_record_name(out, r);
+        out.put(' ');
+        out.write(r.installed);
+        out.write(" installed: No available version in archive\n");
+        return;
+    }
+
+    /* The name to display includes the distribution, if any. With --brief,
+     * only that name is displayed */
+    write_record_name(out, r);
+    if (r.distribution != NULL) {
+        out.put('/');
+        out.write(r.distribution);
+    }
+    if (options.brief) {
+        out.put('\n');
+        return;
+    }
+
+    if (r.state == UPGRADE_AUTOMATIC) {
+        out.write(" upgradeable from ");
+        out.write(r.installed);
+        out.write(" to ");
+        out.write(r.available);
+    } else if (r.state == UPGRADE_MANUAL) {
+        out.write(" *manually* upgradeable from ");
+        out.write(r.installed);
+        out.write(" to ");
+        out.write(r.available);
+    } else if (r.state == UPGRADE_UPTODATE) {
+        out.write(" uptodate ");
+        out.write(r.installed);
+    } else if (r.state == UPGRADE_DOWNGRADE) {
+        out.put(' ');
+        out.write(r.installed);
+        out.write(" newer than version in archive");
+    }
+    out.put('\n');
+}
+
+/**
+ * \brief Shows information about upgradeability of a single package
+ *
+ * \return Whether the package was shown
+ */
+static bool show_upgrade_info(OutputBuffer &out, const UpgradeInfo &info, bool show_uninstalled)
+{
+    const pkgCache::PkgIterator &p = info.pkg;
+
+    if ((p->CurrentVer == 0 && !show_uninstalled))
+        return false;
+    if (!is_wanted(p->SelectedState == pkgCache::State::Hold, info.state))
+        return false;
+    if (options.security && !is_security_upgrade(info))
+        return false;
+
+    if (options.all_versions)
+        show_all_versions(out, p);
+
+    show_record(out, make_record(info));
+    return true;
+}
+
+/**
+ * \brief Read the cycle counter, or the monotonic clock where there is none
+ */
+static inline uint64_t cycle_count()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    return __rdtsc();
+#else
+    return monotonic_ns();
+#endif
+}
+
+/**
+ * \brief The unit of cycle_count(), for --profile-packages
+ */
+#if defined(__i386__) || defined(__x86_64__)
+static const char cycle_unit[] = "cycles";
+#else
+static const char cycle_unit[] = "ns";
+#endif
+
+/**
+ * \brief A package reported by --profile-packages
+ */
+struct ProfileEntry {
+    uint64_t cycles;
+    std::string name;
+    unsigned int versions;
+    /** Files of all versions, except for the dpkg status file */
+    unsigned int files;
+    /** Files whose distribution was not found in the sources.list */
+    unsigned int misses;
+
+    bool operator>(const ProfileEntry &other) const {
+        return cycles > other.cycles;
+    }
+};
+
+/**
+ * \brief The slowest packages of all threads, a heap with the fastest first
+ */
+static std::vector<ProfileEntry> profile;
+static std::mutex profile_lock;
+
+/**
+ * \brief Check whether a time makes it into a heap of the slowest packages
+ */
+static bool is_profiled(const std::vector<ProfileEntry> &heap, uint64_t cycles)
+{
+    return heap.size() < options.profile || cycles > heap.front().cycles;
+}
+
+/**
+ * \brief Add an entry to a heap of the slowest packages, if it is slow enough
+ */
+static void add_profile_entry(std::vector<ProfileEntry> &heap, const ProfileEntry &entry)
+{
+    if (!is_profiled(heap, entry.cycles))
+        return;
+    if (heap.size() == options.profile) {
+        std::pop_heap(heap.begin(), heap.end(), std::greater<ProfileEntry>());
+        heap.pop_back();
+    }
+    heap.push_back(entry);
+    std::push_heap(heap.begin(), heap.end(), std::greater<ProfileEntry>());
+}
+
+/**
+ * \brief Times the packages shown by one thread, for --profile-packages
+ *
+ * Each thread keeps its own heap of the slowest packages, which is merged
+ * into the global one when the profiler is destroyed. The versions and
+ * files of a package are only counted if it is among the slowest so far.
+ */
+class PackageProfiler {
+    std::vector<ProfileEntry> heap;
+
+public:
+    /**
+     * \brief Prepare profiling the packages of a cache
+     *
+     * The tables built on first use are built right away, so that their
+     * cost is not attributed to the first package, as in threaded scans.
+     */
+    explicit PackageProfiler(pkgCache *cache) {
+        if (unlikely(options.profile)) {
+            need_distribution_table(cache);
+            need_priority_table(cache);
+        }
+    }
+
+    ~PackageProfiler() {
+        std::lock_guard<std::mutex> lock(profile_lock);
+        for (auto e = heap.begin(); e != heap.end(); e++)
+            add_profile_entry(profile, *e);
+    }
+
+    /** \brief Get the start time of a package */
+    uint64_t start() const {
+        return unlikely(options.profile) ? cycle_count() : 0;
+    }
+
+    /** \brief Record the time since \a start for a package */
+    void record(const pkgCache::PkgIterator &p, uint64_t start) {
+        if (likely(!options.profile))
+            return;
+
+        ProfileEntry entry = {cycle_count() - start, std::string(), 0, 0, 0};
+        if (!is_profiled(heap, entry.cycles))
+            return;
+
+        entry.name = p.FullName(true);
+        for (auto ver = p.VersionList(); ver.IsGood(); ver++) {
+            entry.versions++;
+            for (auto vf = ver.FileList(); vf.IsGood(); vf++) {
+                if (vf.File()->Flags & pkgCache::Flag::NotSource)
+                    continue;
+                entry.files++;
+                if (file_flags[vf.File()->ID] & FILE_FALLBACK)
+                    entry.misses++;
+            }
+        }
+        add_profile_entry(heap, entry);
+    }
+};
+
+/**
+ * \brief Check whether show_groups() looks at a package with -u
+ */
+static bool is_selected_upgradeable(const pkgCache::PkgIterator &p)
+{
+    return is_selected(p) && may_be_upgradeable(p);
+}
+
+/**
+ * \brief Shows the upgrade information of all packages in a range of groups
+ */
+static void show_groups(OutputBuffer &out, pkgCache *cache,
+                        pkgCache::Group **begin, pkgCache::Group **end)
+{
+    unsigned long visited = 0;
+    unsigned long shown = 0;
+    PackageProfiler profiler(cache);
+
+    for (auto g = begin; g != end; g++) {
+        pkgCache::GrpIterator grp(*cache, *g);
+        for (auto p = grp.PackageList(); !p.end(); p = grp.NextPkg(p)) {
+            visited++;
+            if (!is_selected(p))
+                continue;
+            if (options.upgrades_only && !may_be_upgradeable(p))
+                continue;
+
+            uint64_t start = profiler.start();
+            if (show_upgrade_info(out, determine_upgradeability(p), false))
+                shown++;
+            profiler.record(p, start);
+        }
+    }
+
+    if (unlikely(options.stats)) {
+        stats.packages_visited += visited;
+        stats.packages_shown += shown;
+    }
+}
+
+/**
+ * \brief Serialize a record for the result cache
+ *
+ * A record consists of the state and a flags byte, followed by the name,
+ * architecture, installed version, available version and distribution as
+ * NUL-terminated strings, empty ones meaning NULL.
+ */
+static void write_cache_record(OutputBuffer &out, const Record &r)
+{
+    const char *strings[] = {r.name, r.arch, r.installed, r.available, r.distribution};
+
+    out.put(r.state);
+    out.put((r.qualified ? 1 : 0) | (r.held ? 2 : 0));
+    for (size_t i = 0; i < sizeof(strings) / sizeof(strings[0]); i++) {
+        if (strings[i] != NULL)
+            out.write(strings[i]);
+        out.put('\0');
+    }
+}
+
+/**
+ * \brief Parse a record written by write_cache_record()
+ *
+ * \param pos The position to read from, advanced past the record
+ * \param end The end of the data
+ * \param r The record to fill in
+ * \return false if the data is truncated or invalid
+ */
+static bool read_cache_record(const char *&pos, const char *end, Record &r)
+{
+    const char **strings[] = {&r.name, &r.arch, &r.installed, &r.available, &r.distribution};
+
+    if (end - pos < 2 || (unsigned char) pos[0] > UPGRADE_MANUAL)
+        return false;
+
+    r.state = static_cast<upgrade_state>(pos[0]);
+    r.qualified = pos[1] & 1;
+    r.held = pos[1] & 2;
+    pos += 2;
+
+    for (size_t i = 0; i < sizeof(strings) / sizeof(strings[0]); i++) {
+        const char *nul = static_cast<const char *>(memchr(pos, '\0', end - pos));
+        if (nul == NULL)
+            return false;
+        *strings[i] = nul == pos ? NULL : pos;
+        pos = nul + 1;
+    }
+
+    return r.name != NULL && r.arch != NULL;
+}
+
+/**
+ * \brief Collect the records of all installed packages in a range of groups
+ *
+ * This is used to fill the result cache, so the -n and -u filters are not
+ * applied here.
+ */
+static void collect_groups(OutputBuffer &out, pkgCache *cache,
+                           pkgCache::Group **begin, pkgCache::Group **end)
+{
+    for (auto g = begin; g != end; g++) {
+        pkgCache::GrpIterator grp(*cache, *g);
+        for (auto p = grp.PackageList(); !p.end(); p = grp.NextPkg(p))
+            if (p->CurrentVer != 0 && is_selected(p))
+                write_cache_record(out, make_record(determine_upgradeability(p)));
+    }
+}
+
+/**
+ * \brief Shows the records from the result cache
+ */
+static void show_cached_records(OutputBuffer &out, const char *pos, const char *end)
+{
+    PhaseTimer timer(PHASE_SCAN);
+    Record r;
+
+    while (pos < end && read_cache_record(pos, end, r)) {
+        if (options.stats)
+            stats.packages_visited++;
+        if (is_wanted(r.held, r.state)) {
+            show_record(out, r);
+            if (options.stats)
+                stats.packages_shown++;
+        }
+    }
+}
+
+/**
+ * \brief A function processing a range of groups
+ */
+typedef void (*group_worker)(OutputBuffer &out, pkgCache *cache,
+                             pkgCache::Group **begin, pkgCache::Group **end);
+
+/**
+ * \brief Run a worker on all groups, using several threads if requested
+ *
+ * The groups are split into one contiguous chunk per thread, and each thread
+ * writes into its own buffer. The buffers are then written out in order, so
+ * the output is the same as for a serial run.
+ */
+static void scan_groups(OutputBuffer &out, pkgCache *cache,
+                        std::vector<pkgCache::Group*> &groups, group_worker worker)
+{
+    if (options.threads <= 1 || groups.size() <= 1) {
+        PhaseTimer timer(PHASE_SCAN);
+        worker(out, cache, groups.data(), groups.data() + groups.size());
+        return;
+    }
+
+    size_t nthreads = std::min<size_t>(options.threads, groups.size());
+    size_t chunk = (groups.size() + nthreads - 1) / nthreads;
+    std::vector<OutputBuffer> buffers(nthreads);
+    std::vector<std::thread> workers;
+
+    /* The workers must not build any tables lazily */
+    need_distribution_table(cache);
+    need_priority_table(cache);
+
+    /* The workers do not look at the packages the --arch, --section and
+     * --origin filters reject, nor show_groups() at the ones the -u
+     * pre-filter rejects, so their candidates are not needed either */
+    build_candidate_table(cache, worker == show_groups && options.upgrades_only ?
+                                 is_selected_upgradeable : is_selected);
+
+    PhaseTimer timer(PHASE_SCAN);
+    for (size_t i = 0; i < nthreads; i++) {
+        size_t begin = std::min(i * chunk, groups.size());
+        size_t end = std::min(begin + chunk, groups.size());
+        workers.push_back(std::thread(worker, std::ref(buffers[i]), cache,
+                                      groups.data() + begin,
+                                      groups.data() + end));
+    }
+
+    for (size_t i = 0; i < nthreads; i++) {
+        workers[i].join();
+        out.write(buffers[i]);
+    }
+
+    /* Packages skipped by the filter have no entry, so later lookups, as
+     * in the server, must go to the policy */
+    candidates.clear();
+}
+
+/**
+ * \brief Magic number at the start of the result cache
+ */
+static const char result_cache_magic[8] = {'A', 'S', 'V', 'C', 'A', 'C', 'H', '1'};
+
+/**
+ * \brief Get the path of the result cache
+ */
+static std::string result_cache_path()
+{
+    return _config->Find("APT::Show-Versions::Result-Cache-Dir",
+                         "/var/cache/apt-show-versions") + "/results";
+}
+
+/**
+ * \brief Add the identity of a file to a result cache key
+ */
+static void add_key_file(std::string &key, const std::string &path)
+{
+    struct stat st;
+
+    key += path;
+    if (stat(path.c_str(), &st) == 0) {
+        key += " " + std::to_string(st.st_dev);
+        key += " " + std::to_string(st.st_ino);
+        key += " " + std::to_string(st.st_size);
+        key += " " + std::to_string(st.st_mtim.tv_sec);
+        key += "." + std::to_string(st.st_mtim.tv_nsec);
+    }
+    key += '\n';
+}
+
+/**
+ * \brief Add the identity of a directory and all files in it to a key
+ */
+static void add_key_dir(std::string &key, const std::string &path)
+{
+    std::vector<std::string> names;
+    DIR *dir;
+
+    add_key_file(key, path);
+
+    if ((dir = opendir(path.c_str())) == NULL)
+        return;
+    for (struct dirent *ent; (ent = readdir(dir)) != NULL;)
+        if (ent->d_name[0] != '.')
+            names.push_back(ent->d_name);
+    closedir(dir);
+
+    std::sort(names.begin(), names.end());
+    for (auto name = names.begin(); name != names.end(); name++)
+        add_key_file(key, path + "/" + *name);
+}
+
+/**
+ * \brief Compute the key the result cache is valid for
+ *
+ * This only involves stat() calls on the package cache, the dpkg status
+ * file, the sources.list and preferences files and the lists directory, and
+ * the options influencing the policy. It is thus cheap enough to be checked
+ * before the package cache is opened.
+ */
+static std::string result_cache_key()
+{
+    std::string key;
+
+    add_key_file(key, _config->FindFile("Dir::Cache::pkgcache"));
+    add_key_file(key, _config->FindFile("Dir::State::status"));
+    add_key_file(key, _config->FindDir("Dir::State::lists"));
+    add_key_file(key, _config->FindFile("Dir::Etc::sourcelist"));
+    add_key_dir(key, _config->FindDir("Dir::Etc::sourceparts"));
+    add_key_file(key, _config->FindFile("Dir::Etc::preferences"));
+    add_key_dir(key, _config->FindDir("Dir::Etc::preferencesparts"));
+    key += _config->Find("APT::Architecture") + "\n";
+    key += _config->Find("APT::Default-Release") + "\n";
+
+    return key;
+}
+
+/**
+ * \brief Read the complete contents of a file descriptor
+ */
+static bool read_fd(int fd, std::vector<char> &data)
+{
+    char buf[64 * 1024];
+
+    data.clear();
+    for (;;) {
+        ssize_t res = read(fd, buf, sizeof(buf));
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0)
+            return false;
+        if (res == 0)
+            return true;
+        data.insert(data.end(), buf, buf + res);
+    }
+}
+
+/**
+ * \brief Write a file through a temporary file that is renamed into place
+ *
+ * Concurrent readers thus always see a complete file. Failures are not
+ * reported, except by errno, so that each caller can decide how serious
+ * they are.
+ *
+ * \param writer Writes the contents of the file to the buffer it is given
+ */
+static bool write_file_atomically(const std::string &path,
+                                  const std::function<void(OutputBuffer &)> &writer)
+{
+    std::string temp = path + ".XXXXXX";
+    int fd;
+
+    if ((fd = mkstemp(&temp[0])) < 0)
+        return false;
+    fchmod(fd, 0644);
+
+    bool ok;
+    {
+        OutputBuffer file(fd);
+        writer(file);
+        ok = file.flush();
+    }
+
+    if (close(fd) != 0 || !ok || rename(temp.c_str(), path.c_str()) != 0) {
+        int error = errno;
+        unlink(temp.c_str());
+        errno = error;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * \brief Load the records from the result cache, if it is valid for a key
+ *
+ * \param key The key, as returned by result_cache_key()
+ * \param records Set to the serialized records
+ * \return false if there is no valid result cache
+ */
+static bool load_result_cache(const std::string &key, std::vector<char> &records)
+{
+    std::vector<char> data;
+    uint32_t keysize;
+    int fd;
+
+    if ((fd = open(result_cache_path().c_str(), O_RDONLY | O_CLOEXEC)) < 0)
+        return false;
+
+    bool ok = read_fd(fd, data);
+    close(fd);
+
+    size_t header = sizeof(result_cache_magic) + sizeof(keysize);
+    if (!ok || data.size() < header ||
+        memcmp(data.data(), result_cache_magic, sizeof(result_cache_magic)) != 0)
+        return false;
+
+    memcpy(&keysize, data.data() + sizeof(result_cache_magic), sizeof(keysize));
+    if (keysize != key.size() || data.size() - header < keysize ||
+        memcmp(data.data() + header, key.data(), keysize) != 0)
+        return false;
+
+    records.assign(data.begin() + header + keysize, data.end());
+
+    /* Make sure the records can be read completely */
+    Record r;
+    const char *end = records.data() + records.size();
+    for (const char *pos = records.data(); pos < end;)
+        if (!read_cache_record(pos, end, r))
+            return false;
+
+    return true;
+}
+
+/**
+ * \brief Store records in the result cache
+ */
+static bool save_result_cache(const std::string &key, const OutputBuffer &records)
+{
+    std::string dir = _config->Find("APT::Show-Versions::Result-Cache-Dir",
+                                    "/var/cache/apt-show-versions");
+    std::string path = result_cache_path();
+    uint32_t keysize = key.size();
+
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+        return _error->WarningE("mkdir", "Could not create result cache directory %s", dir.c_str());
+
+    if (!write_file_atomically(path, [&](OutputBuffer &file) {
+            file.write(result_cache_magic, sizeof(result_cache_magic));
+            file.write(reinterpret_cast<const char *>(&keysize), sizeof(keysize));
+            file.write(key);
+            file.write(records);
+        }))
+        return _error->WarningE("write", "Could not write result cache %s", path.c_str());
+
+    return true;
+}
+
+/**
+ * \brief An entry of the --since snapshot
+ */
+struct SnapshotEntry {
+    /** Hash of the name and architecture */
+    uint64_t name;
+    /** Hash of the installed and available versions */
+    uint64_t versions;
+    upgrade_state state;
+
+    bool operator <(const SnapshotEntry &other) const {
+        return name < other.name;
+    }
+};
+
+/**
+ * \brief Magic number at the start of a --since snapshot
+ */
+static const char snapshot_magic[8] = {'A', 'S', 'V', 'S', 'N', 'A', 'P', '1'};
+
+/**
+ * \brief Size of an entry in the snapshot file: two hashes and the state
+ */
+static const size_t snapshot_entry_size = 2 * sizeof(uint64_t) + 1;
+
+/**
+ * \brief The snapshot of the previous --since run, sorted by name hash
+ */
+static std::vector<SnapshotEntry> previous_snapshot;
+
+/**
+ * \brief Continue a 64-bit FNV-1a hash with a string
+ */
+static uint64_t fnv1a(uint64_t hash, const char *s)
+{
+    for (; *s; s++) {
+        hash ^= (unsigned char) *s;
+        hash *= UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+/**
+ * \brief The offset basis of the 64-bit FNV-1a hash
+ */
+static const uint64_t fnv1a_basis = UINT64_C(14695981039346656037);
+
+/**
+ * \brief Compute the snapshot entry of a record
+ */
+static SnapshotEntry make_snapshot_entry(const Record &r)
+{
+    SnapshotEntry e;
+
+    e.name = fnv1a(fnv1a(fnv1a(fnv1a_basis, r.name), ":"), r.arch);
+    e.versions = fnv1a(fnv1a(fnv1a(fnv1a_basis, r.installed ? r.installed : ""), " "),
+                       r.available ? r.available : "");
+    e.state = r.state;
+    return e;
+}
+
+/**
+ * \brief Look up a package in the previous snapshot
+ *
+ * \return The entry, or NULL if the package was not in the snapshot
+ */
+static const SnapshotEntry *find_previous_entry(uint64_t name)
+{
+    SnapshotEntry key;
+
+    key.name = name;
+    auto e = std::lower_bound(previous_snapshot.begin(), previous_snapshot.end(), key);
+    if (e == previous_snapshot.end() || e->name != name)
+        return NULL;
+    return &*e;
+}
+
+/**
+ * \brief Load the snapshot of the previous --since run
+ *
+ * A missing snapshot is treated like an empty one, so the first run shows
+ * all installed packages.
+ */
+static bool load_snapshot(const std::string &path)
+{
+    std::vector<char> data;
+    uint32_t count;
+    int fd;
+
+    previous_snapshot.clear();
+    if ((fd = open(path.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+        if (errno == ENOENT)
+            return true;
+        return _error->Errno("open", "Could not open state file %s", path.c_str());
+    }
+
+    bool ok = read_fd(fd, data);
+    close(fd);
+    if (!ok)
+        return _error->Errno("read", "Could not read state file %s", path.c_str());
+
+    size_t header = sizeof(snapshot_magic) + sizeof(count);
+    if (data.size() >= header)
+        memcpy(&count, data.data() + sizeof(snapshot_magic), sizeof(count));
+    if (data.size() < header ||
+        memcmp(data.data(), snapshot_magic, sizeof(snapshot_magic)) != 0 ||
+        data.size() - header != count * snapshot_entry_size)
+        return _error->Error("State file %s is invalid", path.c_str());
+
+    previous_snapshot.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        const char *pos = data.data() + header + i * snapshot_entry_size;
+        SnapshotEntry &e = previous_snapshot[i];
+
+        memcpy(&e.name, pos, sizeof(e.name));
+        memcpy(&e.versions, pos + sizeof(e.name), sizeof(e.versions));
+        if ((unsigned char) pos[2 * sizeof(uint64_t)] > UPGRADE_MANUAL)
+            return _error->Error("State file %s is invalid", path.c_str());
+        e.state = static_cast<upgrade_state>(pos[2 * sizeof(uint64_t)]);
+    }
+
+    std::sort(previous_snapshot.begin(), previous_snapshot.end());
+    return true;
+}
+
+/**
+ * \brief Replace the --since snapshot
+ */
+static bool save_snapshot(const std::string &path, const std::vector<SnapshotEntry> &entries)
+{
+    uint32_t count = entries.size();
+
+    if (!write_file_atomically(path, [&](OutputBuffer &file) {
+            file.write(snapshot_magic, sizeof(snapshot_magic));
+            file.write(reinterpret_cast<const char *>(&count), sizeof(count));
+            for (auto e = entries.begin(); e != entries.end(); e++) {
+                file.write(reinterpret_cast<const char *>(&e->name), sizeof(e->name));
+                file.write(reinterpret_cast<const char *>(&e->versions), sizeof(e->versions));
+                file.put(e->state);
+            }
+        }))
+        return _error->Errno("write", "Could not write state file %s", path.c_str());
+
+    return true;
+}
+
+/**
+ * \brief Collect the records for --since in a range of groups
+ *
+ * Like collect_groups(), but this also adds records for packages that are
+ * not installed anymore, but were installed in the previous snapshot.
+ */
+static void since_groups(OutputBuffer &out, pkgCache *cache,
+                         pkgCache::Group **begin, pkgCache::Group **end)
+{
+    for (auto g = begin; g != end; g++) {
+        pkgCache::GrpIterator grp(*cache, *g);
+        for (auto p = grp.PackageList(); !p.end(); p = grp.NextPkg(p)) {
+            if (p->CurrentVer == 0 && previous_snapshot.empty())
+                continue;
+
+            Record r = make_record(determine_upgradeability(p));
+            if (p->CurrentVer == 0) {
+                const SnapshotEntry *e = find_previous_entry(make_snapshot_entry(r).name);
+                if (e == NULL || e->state == UPGRADE_NOT_INSTALLED)
+                    continue;
+            }
+            write_cache_record(out, r);
+        }
+    }
+}
+
+/**
+ * \brief Shows the records that changed since the previous snapshot
+ *
+ * The output is flushed before the snapshot is replaced by the current
+ * state, so a failed run is reported again by the next one.
+ */
+static bool show_changes(OutputBuffer &out, const char *pos, const char *end,
+                         const std::string &path)
+{
+    std::vector<SnapshotEntry> entries;
+    Record r;
+
+    while (pos < end && read_cache_record(pos, end, r)) {
+        SnapshotEntry e = make_snapshot_entry(r);
+        const SnapshotEntry *previous = find_previous_entry(e.name);
+        bool changed = previous == NULL ? e.state != UPGRADE_NOT_INSTALLED :
+                       previous->state != e.state || previous->versions != e.versions;
+
+        if (changed && is_wanted(r.held, r.state))
+            show_record(out, r);
+        if (e.state != UPGRADE_NOT_INSTALLED)
+            entries.push_back(e);
+    }
+
+    if (!out.flush())
+        return false;
+
+    std::sort(entries.begin(), entries.end());
+    return save_snapshot(path, entries);
+}
+
+/**
+ * \brief Magic number at the start of an exported snapshot
+ */
+static const char export_magic[8] = {'A', 'S', 'V', 'E', 'X', 'P', 'T', '1'};
+
+/**
+ * \brief Header of an exported snapshot
+ *
+ * The header is followed by the records and then by the string table. All
+ * numbers are in the byte order of the exporting host, which is recorded
+ * in byte_order.
+ */
+struct ExportHeader {
+    char magic[8];
+    /** 0x01020304, to detect snapshots from hosts of the other byte order */
+    uint32_t byte_order;
+    uint32_t records;
+    /** Size of the string table */
+    uint32_t strings;
+};
+
+/**
+ * \brief A record in an exported snapshot
+ *
+ * The strings are offsets of NUL-terminated strings in the string table,
+ * 0 meaning NULL; the string table starts with an empty string.
+ */
+struct ExportRecord {
+    uint32_t name;
+    uint32_t arch;
+    uint32_t installed;
+    uint32_t available;
+    uint32_t distribution;
+    uint8_t state;
+    /** 1 if the name is qualified, 2 if held, as in the result cache */
+    uint8_t flags;
+    uint8_t reserved[2];
+};
+
+/**
+ * \brief Write the records collected by collect_groups() as a snapshot
+ *
+ * Each distinct string is stored only once.
+ */
+static bool export_snapshot(const std::string &path, const char *pos, const char *end)
+{
+    std::vector<ExportRecord> records;
+    std::string strings(1, '\0');
+    std::unordered_map<std::string, uint32_t> offsets;
+    auto add = [&](const char *s) -> uint32_t {
+        if (s == NULL)
+            return 0;
+        auto o = offsets.insert(std::make_pair(std::string(s), (uint32_t) strings.size()));
+        if (o.second) {
+            strings += s;
+            strings += '\0';
+        }
+        return o.first->second;
+    };
+    Record r;
+
+    while (pos < end && read_cache_record(pos, end, r)) {
+        ExportRecord e;
+
+        memset(&e, 0, sizeof(e));
+        e.name = add(r.name);
+        e.arch = add(r.arch);
+        e.installed = add(r.installed);
+        e.available = add(r.available);
+        e.distribution = add(r.distribution);
+        e.state = r.state;
+        e.flags = (r.qualified ? 1 : 0) | (r.held ? 2 : 0);
+        records.push_back(e);
+    }
+
+    ExportHeader header;
+    memcpy(header.magic, export_magic, sizeof(export_magic));
+    header.byte_order = 0x01020304;
+    header.records = records.size();
+    header.strings = strings.size();
+
+    if (!write_file_atomically(path, [&](OutputBuffer &file) {
+            file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            file.write(reinterpret_cast<const char *>(records.data()),
+                       records.size() * sizeof(ExportRecord));
+            file.write(strings);
+        }))
+        return _error->Errno("write", "Could not write snapshot %s", path.c_str());
+
+    return true;
+}
+
+/**
+ * \brief An exported snapshot, mapped into memory
+ */
+class SnapshotFile {
+    void *map;
+    size_t size;
+    ExportHeader header;
+    const char *strings;
+
+    const ExportRecord *record(size_t i) const {
+        return reinterpret_cast<const ExportRecord *>(
+            static_cast<const char *>(map) + sizeof(header)) + i;
+    }
+
+    /** \brief Check all records, and that they are sorted by name */
+    bool valid() const {
+        const char *previous = "";
+
+        for (size_t i = 0; i < header.records; i++) {
+            ExportRecord e;
+
+            memcpy(&e, record(i), sizeof(e));
+            if (e.name == 0 || e.arch == 0 || e.state > UPGRADE_MANUAL ||
+                e.name >= header.strings || e.arch >= header.strings ||
+                e.installed >= header.strings || e.available >= header.strings ||
+                e.distribution >= header.strings)
+                return false;
+            if (strcmp(previous, strings + e.name) > 0)
+                return false;
+            previous = strings + e.name;
+        }
+
+        return true;
+    }
+
+public:
+    SnapshotFile() : map(MAP_FAILED), size(0), strings(NULL) {
+    }
+
+    ~SnapshotFile() {
+        if (map != MAP_FAILED)
+            munmap(map, size);
+    }
+
+    /** \brief Map and check a snapshot, adding errors if it is invalid */
+    bool open(const std::string &path) {
+        struct stat st;
+        int fd;
+
+        if ((fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC)) < 0)
+            return _error->Errno("open", "Could not open snapshot %s", path.c_str());
+        if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(header)) {
+            close(fd);
+            return _error->Error("Snapshot %s is invalid", path.c_str());
+        }
+
+        size = st.st_size;
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+            return _error->Errno("mmap", "Could not map snapshot %s", path.c_str());
+
+        const char *data = static_cast<const char *>(map);
+        size_t records_size;
+
+        memcpy(&header, data, sizeof(header));
+        records_size = (size_t) header.records * sizeof(ExportRecord);
+        strings = data + sizeof(header) + records_size;
+
+        if (memcmp(header.magic, export_magic, sizeof(export_magic)) != 0 ||
+            header.byte_order != 0x01020304 || header.strings == 0 ||
+            size != sizeof(header) + records_size + header.strings ||
+            strings[header.strings - 1] != '\0' || !valid())
+            return _error->Error("Snapshot %s is invalid", path.c_str());
+
+        return true;
+    }
+
+    /** \brief The number of records */
+    size_t count() const {
+        return header.records;
+    }
+
+    /** \brief Get a record, with strings pointing into the mapping */
+    Record get(size_t i) const {
+        ExportRecord e;
+        Record r;
+
+        memcpy(&e, record(i), sizeof(e));
+        r.name = strings + e.name;
+        r.arch = strings + e.arch;
+        r.installed = e.installed ? strings + e.installed : NULL;
+        r.available = e.available ? strings + e.available : NULL;
+        r.distribution = e.distribution ? strings + e.distribution : NULL;
+        r.state = static_cast<upgrade_state>(e.state);
+        r.qualified = e.flags & 1;
+        r.held = e.flags & 2;
+        return r;
+    }
+};
+
+/**
+ * \brief Shows the records of an exported snapshot, for --from-snapshot
+ *
+ * The snapshot is mapped into memory and the records are shown straight
+ * from the mapping, so neither the package cache nor the policy is needed.
+ *
+ * \param patterns If not empty, only show packages with these names, which
+ *                 may be qualified with an architecture
+ * \return The exit code
+ */
+static int show_snapshot(const std::string &path, const char **patterns)
+{
+    std::set<std::string> names;
+    SnapshotFile snapshot;
+
+    for (size_t i = 0; patterns[i]; i++)
+        names.insert(patterns[i]);
+
+    if (!snapshot.open(path))
+        return 1;
+
+    OutputBuffer out(STDOUT_FILENO);
+    for (size_t i = 0; i < snapshot.count(); i++) {
+        Record r = snapshot.get(i);
+
+        if (!names.empty() && names.count(r.name) == 0 &&
+            names.count(std::string(r.name) + ":" + r.arch) == 0)
+            continue;
+        if (is_wanted(r.held, r.state))
+            show_record(out, r);
+    }
+
+    return out.flush() ? 0 : 1;
+}
+
+/**
+ * \brief The hosts having a package in one state, for --aggregate
+ */
+struct AggregateEntry {
+    bool qualified;
+    /** Indices of the snapshots, in the order of the command line */
+    std::vector<size_t> hosts;
+};
+
+/**
+ * \brief Shows the aggregated state of one package name
+ *
+ * \param entries The entries, by architecture and state
+ * \param files The snapshot files, naming the hosts
+ */
+static void show_aggregate(OutputBuffer &out, const char *name,
+                           const std::map<std::pair<std::string, int>, AggregateEntry> &entries,
+                           const char **files)
+{
+    for (auto e = entries.begin(); e != entries.end(); e++) {
+        const std::string &arch = e->first.first;
+        const char *state = upgrade_state_names[e->first.second];
+        const std::vector<size_t> &hosts = e->second.hosts;
+
+        if (options.format == FORMAT_TEXT) {
+            out.write(name);
+            if (e->second.qualified) {
+                out.put(':');
+                out.write(arch);
+            }
+            out.put(' ');
+            out.write(state);
+            out.put(' ');
+            out.write(std::to_string(hosts.size()));
+            for (auto h = hosts.begin(); h != hosts.end(); h++) {
+                out.put(' ');
+                out.write(files[*h]);
+            }
+        } else {
+            write_field(out, true, "package", name);
+            write_field(out, false, "arch", arch.c_str());
+            write_field(out, false, "state", state);
+            /* The count is a number in JSON, not a string */
+            if (options.format == FORMAT_JSONL)
+                out.write(",\"count\":");
+            else
+                out.put('\t');
+            out.write(std::to_string(hosts.size()));
+            if (options.format == FORMAT_JSONL)
+                out.write(",\"hosts\":[");
+            else
+                out.put('\t');
+            for (auto h = hosts.begin(); h != hosts.end(); h++) {
+                if (h != hosts.begin())
+                    out.put(',');
+                if (options.format == FORMAT_JSONL)
+                    write_json_string(out, files[*h]);
+                else
+                    out.write(files[*h]);
+            }
+            if (options.format == FORMAT_JSONL)
+                out.write("]}");
+        }
+        out.put('\n');
+    }
+}
+
+/**
+ * \brief Merge exported snapshots of many hosts, for --aggregate
+ *
+ * The snapshots are sorted by name, in the order of sorted_groups(), so they
+ * are merged with a heap holding the current position in each snapshot.
+ * Only the records of one package name are held at a time, so memory use
+ * does not grow with the number of packages. For each name, architecture
+ * and state passing -u and -n, the number of hosts and the hosts are shown.
+ *
+ * \param files The snapshot files, which also name the hosts
+ * \return The exit code
+ */
+static int aggregate_snapshots(const char **files)
+{
+    std::vector<std::unique_ptr<SnapshotFile> > snapshots;
+    std::vector<size_t> positions;
+
+    for (size_t i = 0; files[i]; i++) {
+        snapshots.push_back(std::unique_ptr<SnapshotFile>(new SnapshotFile));
+        if (!snapshots.back()->open(files[i]))
+            return 1;
+    }
+    positions.assign(snapshots.size(), 0);
+
+    typedef std::pair<const char *, size_t> Head;
+    auto later = [](const Head &a, const Head &b) {
+        int c = strcmp(a.first, b.first);
+        return c > 0 || (c == 0 && a.second > b.second);
+    };
+    std::priority_queue<Head, std::vector<Head>, decltype(later)> heads(later);
+
+    for (size_t i = 0; i < snapshots.size(); i++)
+        if (snapshots[i]->count() > 0)
+            heads.push(Head(snapshots[i]->get(0).name, i));
+
+    OutputBuffer out(STDOUT_FILENO);
+    std::map<std::pair<std::string, int>, AggregateEntry> entries;
+    while (!heads.empty()) {
+        std::string name = heads.top().first;
+
+        entries.clear();
+        while (!heads.empty() && name == heads.top().first) {
+            size_t i = heads.top().second;
+            const SnapshotFile &snapshot = *snapshots[i];
+
+            heads.pop();
+            for (; positions[i] < snapshot.count(); positions[i]++) {
+                Record r = snapshot.get(positions[i]);
+                if (name != r.name) {
+                    heads.push(Head(r.name, i));
+                    break;
+                }
+                if (!is_wanted(r.held, r.state))
+                    continue;
+
+                AggregateEntry &entry = entries[std::make_pair(std::string(r.arch), (int) r.state)];
+                entry.qualified = r.qualified;
+                if (entry.hosts.empty() || entry.hosts.back() != i)
+                    entry.hosts.push_back(i);
+            }
+        }
+
+        show_aggregate(out, name.c_str(), entries, files);
+    }
+
+    return out.flush() ? 0 : 1;
+}
+
+/**
+ * \brief Check the options for conflicts
+ *
+ * Errors are added to the global error list.
+ */
+static void check_options(bool have_patterns)
+{
+    if (have_patterns && options.no_hold) {
+        _error->Error("Cannot specify -n|--no-hold with a package name");
+    }
+    if (!have_patterns && options.regex_all) {
+        _error->Error("Cannot specify -R|--regex-all without a pattern");
+    }
+    if (options.format != FORMAT_TEXT && (options.all_versions || options.brief)) {
+        _error->Error("Cannot specify -a|--allversions or -b|--brief with --format");
+    }
+    if (options.check && (options.all_versions || options.brief ||
+                          options.format != FORMAT_TEXT || !options.since.empty())) {
+        _error->Error("Cannot specify --check with -a|--allversions, -b|--brief, --format or --since");
+    }
+    if (!options.since.empty() && (have_patterns || options.all_versions)) {
+        _error->Error("Cannot specify --since with -a|--allversions or a package name");
+    }
+    if (!options.export_snapshot.empty() && have_patterns) {
+        _error->Error("Cannot specify --export-snapshot with a package name");
+    }
+    if ((!options.from_snapshot.empty() || options.aggregate) && options.all_versions) {
+        _error->Error("Cannot specify --from-snapshot or --aggregate with -a|--allversions");
+    }
+    if (options.security && (!options.since.empty() || !options.export_snapshot.empty() ||
+                             !options.from_snapshot.empty() || options.aggregate)) {
+        _error->Error("Cannot specify --security with --since or the snapshot options");
+    }
+    if ((!options.arch.empty() || !options.section.empty() || !options.origin.empty()) &&
+        (!options.since.empty() || !options.from_snapshot.empty() || options.aggregate)) {
+        _error->Error("Cannot specify --arch, --section or --origin with --since, "
+                      "--from-snapshot or --aggregate");
+    }
+}
+
+/**
+ * \brief Reset all tables derived from the cache and the policy
+ *
+ * Only the string and suite tables are built right away. The others are
+ * built on first use, so that the source list and the policy are only read
+ * when needed.
+ */
+static void reset_tables(pkgCache *cache)
+{
+    PhaseTimer timer(PHASE_TABLES);
+
+    list = NULL;
+    policy = NULL;
+    candidates.clear();
+    distributions.clear();
+    priorities.clear();
+    build_string_table(cache);
+    build_suite_table(cache);
+    build_filter_table(cache);
+}
+
+/**
+ * \brief Check whether a file was modified after a given time
+ */
+static bool modified_after(const std::string &path, time_t time)
+{
+    struct stat st;
+
+    return stat(path.c_str(), &st) == 0 && st.st_mtime > time;
+}
+
+/**
+ * \brief Check whether a read-only package cache is up to date
+ *
+ * This is a cheaper version of the check APT does before using the cache:
+ * each package file must still have the size and modification time stored
+ * in the cache, and the sources.list files must not have been modified
+ * after the cache was built.
+ */
+static bool cache_is_current(pkgCache *cache)
+{
+    std::string sourceparts = _config->FindDir("Dir::Etc::sourceparts");
+    struct stat st;
+    DIR *dir;
+
+    if (stat(_config->FindFile("Dir::Cache::pkgcache").c_str(), &st) != 0)
+        return false;
+    time_t built = st.st_mtime;
+
+    for (auto file = cache->FileBegin(); file != cache->FileEnd(); file++) {
+        if (file->FileName == 0)
+            continue;
+        if (stat(file.FileName(), &st) != 0 ||
+            (unsigned long) st.st_size != file->Size || st.st_mtime != file->mtime)
+            return false;
+    }
+
+    if (modified_after(_config->FindFile("Dir::Etc::sourcelist"), built) ||
+        modified_after(sourceparts, built))
+        return false;
+
+    if ((dir = opendir(sourceparts.c_str())) == NULL)
+        return true;
+
+    bool current = true;
+    for (struct dirent *ent; current && (ent = readdir(dir)) != NULL;)
+        if (ent->d_name[0] != '.' && modified_after(sourceparts + ent->d_name, built))
+            current = false;
+    closedir(dir);
+    return current;
+}
+
+/**
+ * \brief Open the package cache, and build the tables for it
+ *
+ * This replaces the cache file, if any, so it can also be used to reload
+ * the cache.
+ *
+ * With --cache-read-only, pkgcache.bin is mapped as it is, and never
+ * regenerated. If it is out of date, it is mapped again until it is current
+ * or --cache-wait seconds have passed, after which the outdated cache is
+ * used with a warning. The cache stays consistent while APT replaces it.
+ */
+static bool open_cache(std::unique_ptr<pkgCacheFile> &cachefile)
+{
+    uint64_t deadline = monotonic_ns() + options.cache_wait * UINT64_C(1000000000);
+    pkgCache *cache;
+
+    if (options.cache_read_only)
+        _config->Set("pkgCacheFile::Generate", false);
+
+    for (;;) {
+        list = NULL;
+        policy = NULL;
+        policy_incomplete = false;
+        candidates.clear();
+        cachefile.reset();
+        cachefile.reset(new pkgCacheFile);
+
+        {
+            PhaseTimer timer(PHASE_CACHE);
+            cache = cachefile->GetPkgCache();
+        }
+
+        lazy_cachefile = cachefile.get();
+        if (cache == NULL || _error->PendingError())
+            return false;
+
+        if (!options.cache_read_only || cache_is_current(cache))
+            break;
+        if (monotonic_ns() >= deadline) {
+            _error->Warning("The package cache is out of date, showing its state anyway");
+            break;
+        }
+
+        /* APT replaces the cache once it is done updating the lists */
+        poll(NULL, 0, 100);
+    }
+
+    reset_tables(cache);
+    return true;
+}
+
+/**
+ * \brief Magic number at the start of the group order index
+ */
+static const char order_magic[8] = {'A', 'S', 'V', 'O', 'R', 'D', 'R', '2'};
+
+/**
+ * \brief Compute the key the group order index is valid for
+ *
+ * Besides the identity of pkgcache.bin, this includes the size and counts
+ * of the loaded cache, so that an index is not used for a cache which was
+ * built in memory instead of being loaded from that file.
+ */
+static std::string order_key(pkgCache *cache)
+{
+    std::string key;
+
+    add_key_file(key, _config->FindFile("Dir::Cache::pkgcache"));
+    key += std::to_string(cache->GetMap().Size());
+    key += " " + std::to_string(cache->HeaderP->GroupCount);
+    key += " " + std::to_string(cache->HeaderP->PackageCount);
+    key += '\n';
+    return key;
+}
+
+/**
+ * \brief A mapped group order index
+ *
+ * The index consists of the magic number, the size of the key, the key and
+ * the offsets of all groups in the cache, in the order of their names.
+ */
+class GroupOrderIndex {
+    void *map;
+    size_t size;
+    const char *offsets;
+    size_t entries;
+
+public:
+    GroupOrderIndex() : map(MAP_FAILED), size(0), offsets(NULL), entries(0) {
+    }
+
+    ~GroupOrderIndex() {
+        if (map != MAP_FAILED)
+            munmap(map, size);
+    }
+
+    /**
+     * \brief Map the index, and check that it is valid for the cache
+     *
+     * Each offset must point to a group in the cache. Whether each group
+     * appears exactly once is left to the caller.
+     *
+     * \return false if there is no valid index for the cache
+     */
+    bool open(pkgCache *cache, const std::string &key) {
+        std::string path = _config->FindFile("Dir::Cache::ShowVersionsOrder");
+        size_t header = sizeof(order_magic) + sizeof(uint32_t) + key.size();
+        size_t groups = cache->GetMap().Size() / sizeof(pkgCache::Group);
+        struct stat st;
+        uint32_t keysize;
+        int fd;
+
+        entries = cache->HeaderP->GroupCount;
+        if (path.empty() || (fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC)) < 0)
+            return false;
+        if (fstat(fd, &st) != 0 || (size_t) st.st_size != header + entries * sizeof(uint32_t)) {
+            close(fd);
+            return false;
+        }
+
+        size = st.st_size;
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+            return false;
+
+        const char *data = static_cast<const char *>(map);
+        memcpy(&keysize, data + sizeof(order_magic), sizeof(keysize));
+        if (memcmp(data, order_magic, sizeof(order_magic)) != 0 || keysize != key.size() ||
+            memcmp(data + sizeof(order_magic) + sizeof(keysize), key.data(), keysize) != 0)
+            return false;
+
+        offsets = data + header;
+        for (size_t i = 0; i < entries; i++) {
+            uint32_t offset = get(i);
+            if (offset == 0 || offset >= groups)
+                return false;
+        }
+        return true;
+    }
+
+    /** \brief The number of groups */
+    size_t count() const {
+        return entries;
+    }
+
+    /** \brief The offset of the group at a position in the order */
+    uint32_t get(size_t i) const {
+        uint32_t offset;
+        memcpy(&offset, offsets + i * sizeof(offset), sizeof(offset));
+        return offset;
+    }
+};
+
+/**
+ * \brief Load the group order index
+ *
+ * \return false if there is no valid index for the cache
+ */
+static bool load_group_order(pkgCache *cache, const std::string &key,
+                             std::vector<pkgCache::Group*> &groups)
+{
+    GroupOrderIndex index;
+
+    if (!index.open(cache, key))
+        return false;
+
+    /* Each group must appear exactly once */
+    std::vector<bool> seen(index.count(), false);
+    groups.resize(index.count());
+    for (size_t i = 0; i < index.count(); i++) {
+        pkgCache::Group *g = cache->GrpP + index.get(i);
+        if (g->ID >= index.count() || seen[g->ID])
+            return false;
+        seen[g->ID] = true;
+        groups[i] = g;
+    }
+
+    return true;
+}
+
+/**
+ * \brief Store the group order index
+ *
+ * This is an optimisation only, so errors are not reported: the index is
+ * usually not writable for users other than root.
+ */
+static void save_group_order(pkgCache *cache, const std::string &key,
+                             const std::vector<pkgCache::Group*> &groups)
+{
+    std::string path = _config->FindFile("Dir::Cache::ShowVersionsOrder");
+    uint32_t keysize = key.size();
+
+    if (path.empty())
+        return;
+
+    write_file_atomically(path, [&](OutputBuffer &file) {
+        file.write(order_magic, sizeof(order_magic));
+        file.write(reinterpret_cast<const char *>(&keysize), sizeof(keysize));
+        file.write(key);
+        for (auto g = groups.begin(); g != groups.end(); g++) {
+            uint32_t offset = *g - cache->GrpP;
+            file.write(reinterpret_cast<const char *>(&offset), sizeof(offset));
+        }
+    });
+}
+
+/**
+ * \brief Get the first eight bytes of a string as a big-endian number
+ *
+ * Shorter strings are padded with zeroes, so comparing the prefixes gives
+ * the same result as strcmp() whenever they differ.
+ */
+static uint64_t name_prefix(const char *name)
+{
+    uint64_t prefix = 0;
+    size_t i;
+
+    for (i = 0; i < 8 && name[i] != '\0'; i++)
+        prefix = (prefix << 8) | (unsigned char) name[i];
+    return i == 0 ? 0 : prefix << (8 * (8 - i));
+}
+
+/**
+ * \brief Get all groups, sorted by name
+ *
+ * The order only depends on the cache, so it is stored in the group order
+ * index (Dir::Cache::ShowVersionsOrder) and loaded from there as long as
+ * the cache does not change. Otherwise, the groups are sorted by a prefix of
+ * their names first, so most comparisons do not touch the string pool.
+ */
+static std::vector<pkgCache::Group*> sorted_groups(pkgCache *cache)
+{
+    PhaseTimer timer(PHASE_SORT);
+    std::string key = order_key(cache);
+    std::vector<pkgCache::Group*> groups;
+
+    if (load_group_order(cache, key, groups))
+        return groups;
+
+    std::vector<std::pair<uint64_t, pkgCache::Group*> > keyed(cache->HeaderP->GroupCount);
+    for (auto p = cache->GrpBegin(); p != cache->GrpEnd(); p++)
+        keyed[p->ID] = std::make_pair(name_prefix(p.Name()), static_cast<pkgCache::Group *>(p));
+
+    std::sort(keyed.begin(), keyed.end(),
+              [cache](const std::pair<uint64_t, pkgCache::Group*> &a,
+                      const std::pair<uint64_t, pkgCache::Group*> &b) {
+                if (a.first != b.first)
+                    return a.first < b.first;
+                return strcmp(cache->StrP + a.second->Name,
+                              cache->StrP + b.second->Name) < 0;
+    });
+
+    groups.resize(keyed.size());
+    for (size_t i = 0; i < keyed.size(); i++)
+        groups[i] = keyed[i].second;
+
+    save_group_order(cache, key, groups);
+    return groups;
+}
+
+/**
+ * \brief Run a worker on all groups in the order of the group order index
+ *
+ * Unlike sorted_groups(), this does not hold all groups in memory: the
+ * groups are taken from the mapped index and passed to the worker in small
+ * chunks. Groups are not checked to appear only once, which the key of an
+ * index written by save_group_order() guarantees anyway.
+ *
+ * \return false if there is no valid index, in which case nothing is done
+ */
+static bool scan_group_order(OutputBuffer &out, pkgCache *cache, group_worker worker)
+{
+    pkgCache::Group *chunk[256];
+    GroupOrderIndex index;
+
+    {
+        PhaseTimer timer(PHASE_SORT);
+        if (!index.open(cache, order_key(cache)))
+            return false;
+    }
+
+    PhaseTimer timer(PHASE_SCAN);
+    for (size_t i = 0; i < index.count();) {
+        size_t n;
+        for (n = 0; n < sizeof(chunk) / sizeof(chunk[0]) && i < index.count(); n++, i++)
+            chunk[n] = cache->GrpP + index.get(i);
+        worker(out, cache, chunk, chunk + n);
+    }
+    return true;
+}
+
+/**
+ * \brief The packages matching a single pattern
+ */
+struct PatternResult {
+    std::set<pkgCache::PkgIterator> pkgs;
+    APT::PackageContainerInterface::Constructor constructor;
+    /** The error messages produced while resolving the pattern */
+    std::string errors;
+};
+
+/**
+ * \brief Resolve a pattern using APT::PackageSet::FromString()
+ */
+static void resolve_with_apt(pkgCacheFile &cachefile, const std::string &pattern,
+                             PatternResult &result)
+{
+    auto pkgs = APT::PackageSet::FromString(cachefile, pattern);
+
+    result.pkgs.insert(pkgs.begin(), pkgs.end());
+    result.constructor = pkgs.getConstructor();
+
+    if (!_error->empty()) {
+        std::ostringstream errors;
+        _error->DumpErrors(errors);
+        result.errors = errors.str();
+    }
+}
+
+/**
+ * \brief Resolve all patterns at once
+ *
+ * Package names are looked up in the hash table, and all regular expressions
+ * are matched in a single walk over the groups, the same way as
+ * APT::PackageSet::FromString() matches them. Patterns with an architecture
+ * or a task, invalid regular expressions and patterns not matching anything
+ * are passed to APT::PackageSet::FromString() itself, so they produce the
+ * same results and error messages.
+ *
+ * \return The result for each pattern, in the order of the patterns
+ */
+static std::vector<PatternResult> resolve_patterns(pkgCacheFile &cachefile,
+                                                   const char **patterns)
+{
+    PhaseTimer timer(PHASE_PATTERNS);
+    static const char isregex[] = ".?+*|[^$";
+    pkgCache *cache = cachefile.GetPkgCache();
+    std::vector<PatternResult> results;
+    std::vector<size_t> regex_patterns;
+    size_t count = 0;
+
+    while (patterns[count])
+        count++;
+
+    results.resize(count);
+    std::vector<regex_t> regexes(count);
+
+    for (size_t i = 0; i < count; i++) {
+        std::string pattern = patterns[i];
+        PatternResult &result = results[i];
+
+        result.constructor = APT::PackageContainerInterface::UNKNOWN;
+
+        if (pattern.empty() || pattern.find(':') != std::string::npos ||
+            pattern[pattern.size() - 1] == '^') {
+            resolve_with_apt(cachefile, pattern, result);
+            continue;
+        }
+
+        /* Names such as g++ take precedence over regular expressions */
+        auto grp = cache->FindGrp(pattern);
+        if (!grp.end()) {
+            auto pkg = grp.FindPreferredPkg();
+            if (!pkg.end()) {
+                result.pkgs.insert(pkg);
+                continue;
+            }
+        }
+
+        if (pattern.find_first_of(isregex) == std::string::npos ||
+            regcomp(&regexes[regex_patterns.size()], pattern.c_str(),
+                    REG_EXTENDED | REG_ICASE | REG_NOSUB) != 0) {
+            resolve_with_apt(cachefile, pattern, result);
+            continue;
+        }
+
+        regex_patterns.push_back(i);
+    }
+
+    if (regex_patterns.empty())
+        return results;
+
+    std::vector<std::string> archs = APT::Configuration::getArchitectures();
+    for (auto grp = cache->GrpBegin(); grp != cache->GrpEnd(); grp++) {
+        for (size_t r = 0; r < regex_patterns.size(); r++) {
+            if (regexec(&regexes[r], grp.Name(), 0, NULL, 0) != 0)
+                continue;
+
+            auto pkg = grp.FindPkg("native");
+            for (auto a = archs.begin(); a != archs.end() && pkg.end(); a++)
+                pkg = grp.FindPkg(*a);
+            if (!pkg.end())
+                results[regex_patterns[r]].pkgs.insert(pkg);
+        }
+    }
+
+    for (size_t r = 0; r < regex_patterns.size(); r++) {
+        PatternResult &result = results[regex_patterns[r]];
+
+        regfree(&regexes[r]);
+        if (result.pkgs.empty())
+            resolve_with_apt(cachefile, patterns[regex_patterns[r]], result);
+        else
+            result.constructor = APT::PackageContainerInterface::REGEX;
+    }
+
+    return results;
+}
+
+/**
+ * \brief Shows the packages matching the patterns, or all installed ones
+ *
+ * \param out The buffer to write the output to
+ * \param err The stream to dump errors to
+ * \param cachefile The cache to look at
+ * \param patterns A NULL-terminated array of patterns
+ * \return The exit code
+ */
+static int show_packages(OutputBuffer &out, std::ostream &err,
+                         pkgCacheFile &cachefile, const char **patterns)
+{
+    if (patterns[0] == NULL) {
+        /* Only sort the groups in memory if there is no index yet */
+        if (options.low_memory && scan_group_order(out, cachefile.GetPkgCache(), show_groups))
+            return 0;
+
+        std::vector<pkgCache::Group*> groups = sorted_groups(cachefile.GetPkgCache());
+
+        scan_groups(out, cachefile.GetPkgCache(), groups, show_groups);
+        return 0;
+    }
+
+    std::vector<PatternResult> results = resolve_patterns(cachefile, patterns);
+    PackageProfiler profiler(cachefile.GetPkgCache());
+    PhaseTimer timer(PHASE_SCAN);
+
+    for (size_t i = 0; patterns[i]; i++) {
+        std::string pattern = patterns[i];
+        const PatternResult &result = results[i];
+
+        if (!result.errors.empty()) {
+            out.flush();
+            err << result.errors;
+        }
+
+        /* State of the first package, for the exit code below */
+        upgrade_state first_state = UPGRADE_NOT_INSTALLED;
+        for (auto pp = result.pkgs.begin(); pp != result.pkgs.end(); pp++) {
+            if (!is_selected(*pp))
+                continue;
+
+            uint64_t start = profiler.start();
+            const UpgradeInfo info = determine_upgradeability(*pp);
+            if (pp == result.pkgs.begin())
+                first_state = info.state;
+
+            bool shown = show_upgrade_info(out, info, options.regex_all || result.constructor ==
+                                           APT::PackageContainerInterface::UNKNOWN);
+            profiler.record(*pp, start);
+            if (options.stats) {
+                stats.packages_visited++;
+                stats.packages_shown += shown;
+            }
+        }
+
+        /* If only a single package name is given, and -u is specified,
+         * we should exit with code 2.
+         */
+        if (result.constructor == APT::PackageContainerInterface::UNKNOWN
+            && patterns[1] == NULL
+            && options.upgrades_only
+            && pattern.find('*') == std::string::npos
+            && first_state < UPGRADE_AUTOMATIC)
+            return 2;
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Exit codes of --check
+ */
+enum check_status {
+    CHECK_UPGRADEABLE = 0,
+    CHECK_UPTODATE = 2,
+    CHECK_NOT_AVAILABLE = 3,
+};
+
+/**
+ * \brief The state of a package as far as --check is concerned
+ *
+ * With --security, packages which cannot be upgraded from a security
+ * archive count as up to date.
+ */
+static upgrade_state checked_state(const UpgradeInfo &info)
+{
+    if (options.security && info.state >= UPGRADE_AUTOMATIC && !is_security_upgrade(info))
+        return UPGRADE_UPTODATE;
+    return info.state;
+}
+
+/**
+ * \brief Check whether any of the packages is upgradeable, for --check
+ *
+ * This stops at the first upgradeable package and shows nothing but errors.
+ * Without patterns, the installed packages are looked at in cache order,
+ * with the -u pre-filter, and only until one is found. With --security,
+ * only upgrades from security archives count.
+ *
+ * \param err The stream to dump errors to
+ * \param cachefile The cache to look at
+ * \param patterns A NULL-terminated array of patterns
+ * \return CHECK_UPGRADEABLE if a package is upgradeable, otherwise
+ *         CHECK_UPTODATE if any package is available in the archive, and
+ *         CHECK_NOT_AVAILABLE if none is
+ */
+static int check_packages(std::ostream &err, pkgCacheFile &cachefile, const char **patterns)
+{
+    pkgCache *cache = cachefile.GetPkgCache();
+    upgrade_state best = UPGRADE_NOT_INSTALLED;
+
+    if (patterns[0] == NULL) {
+        for (auto p = cache->PkgBegin(); !p.end(); p++) {
+            if (p->CurrentVer == 0 || !is_selected(p))
+                continue;
+            if (options.no_hold && p->SelectedState == pkgCache::State::Hold)
+                continue;
+
+            /* Rejected packages only matter until one is available */
+            if (!may_be_upgradeable(p)) {
+                if (best < UPGRADE_UPTODATE)
+                    best = std::max(best, determine_upgradeability(p).state);
+                continue;
+            }
+
+            upgrade_state state = checked_state(determine_upgradeability(p));
+            if (state >= UPGRADE_AUTOMATIC)
+                return CHECK_UPGRADEABLE;
+            best = std::max(best, state);
+        }
+    } else {
+        std::vector<PatternResult> results = resolve_patterns(cachefile, patterns);
+
+        for (auto result = results.begin(); result != results.end(); result++) {
+            err << result->errors;
+
+            for (auto p = result->pkgs.begin(); p != result->pkgs.end(); p++) {
+                if (!is_selected(*p))
+                    continue;
+                upgrade_state state = checked_state(determine_upgradeability(*p));
+                if (state >= UPGRADE_AUTOMATIC)
+                    return CHECK_UPGRADEABLE;
+                best = std::max(best, state);
+            }
+        }
+    }
+
+    return best >= UPGRADE_UPTODATE ? CHECK_UPTODATE : CHECK_NOT_AVAILABLE;
+}
 
 /**
- * \brief The official suites
+ * \brief Set by signal handlers to stop the server
+ */
+static volatile sig_atomic_t stop_serving;
+
+static void handle_stop_signal(int)
+{
+    stop_serving = 1;
+}
+
+/**
+ * \brief Set an option given in a query
  *
- * The first element is obviously not an official suite, it is just added to
- * make code writing easier.
+ * \return false if the option is unknown
  */
-static const char *official_suites[] = {
-    "",
-    "oldstable",
-    "stable",
-    "proposed-updates",
-    "stable-updates",
-    "testing",
-    "testing-proposed-updates",
-    "testing-updates",
-    "unstable",
-    "experimental",
-    NULL
-};
+static bool set_query_option(const std::string &word)
+{
+    if (word == "-u" || word == "--upgradeable")
+        options.upgrades_only = true;
+    else if (word == "-b" || word == "--brief")
+        options.brief = true;
+    else if (word == "-a" || word == "--allversions")
+        options.all_versions = true;
+    else if (word == "-n" || word == "--no-hold")
+        options.no_hold = true;
+    else if (word == "-R" || word == "--regex-all")
+        options.regex_all = true;
+    else if (word == "--security")
+        options.security = true;
+    else if (word == "-q" || word == "--check")
+        options.check = true;
+    else if (word.compare(0, 9, "--format=") == 0)
+        return set_format(word.substr(9));
+    else if (word.compare(0, 7, "--arch=") == 0)
+        options.arch = word.substr(7);
+    else if (word.compare(0, 10, "--section=") == 0)
+        options.section = word.substr(10);
+    else if (word.compare(0, 9, "--origin=") == 0)
+        options.origin = word.substr(9);
+    else
+        return _error->Error("Unknown option %s", word.c_str());
+
+    return true;
+}
 
 /**
- * \brief Find a distribution in the sources.list file
+ * \brief Parse a query sent to the server
  *
- * This keeps a cache of previous call results, as a lookup currently involves
- * several stat() syscalls when calling FindInCache().
+ * A query is a line of words separated by whitespace. Each word is either
+ * one of the options -u, -b, -a, -n, -R and -q (or their long forms), one of
+ * --security, --format=FORMAT, --arch=ARCH, --section=SECTION and
+ * --origin=ORIGIN, or a pattern. Short options may be combined, as
+ * in -ub. The options are applied to the global options.
  */
-static const std::string& find_distribution_name(pkgCache::PkgFileIterator file)
+static bool parse_query(const std::string &line, std::vector<std::string> &patterns)
 {
-    static std::map<unsigned int, std::string> map;
+    std::istringstream words(line);
+    std::string word;
 
-    try {
-        return map.at(file->ID);
-    } catch (const std::out_of_range& e) {
+    while (words >> word) {
+        if (word[0] != '-') {
+            patterns.push_back(word);
+        } else if (word.size() > 2 && word[1] != '-') {
+            for (size_t i = 1; i < word.size(); i++)
+                if (!set_query_option(std::string("-") + word[i]))
+                    return false;
+        } else if (!set_query_option(word)) {
+            return false;
+        }
     }
 
-    for (auto i = list->begin(); i != list->end(); ++i) {
-        vector<pkgIndexFile *> *indexes = (*i)->GetIndexFiles();
-        for (auto filep = indexes->begin(); filep != indexes->end(); ++filep) {
-            if ((*filep)->FindInCache(*file.Cache()) == file) {
-                std::string distro = (**i).GetDist();
-                /* For stable/updates and similar, we want to display stable */
-                size_t subdistro = distro.find_first_of('/');
-                if (subdistro != std::string::npos)
-                    distro.erase(subdistro);
-
-                if ((file->Archive && distro == file.Archive()) ||
-                    (file->Codename && distro == file.Codename()))
-                    return map[file->ID] = distro;
-            }
-      }
-   }
+    return true;
+}
+
+/**
+ * \brief Build the query for the current options and the given patterns
+ */
+static std::string build_query(const char **patterns)
+{
+    std::string query;
 
-    if (file->Archive)
-        return map[file->ID] = std::string(file.Archive());
-    if (file->Codename)
-        return map[file->ID] = std::string(file.Codename());
-    return map[file->ID] = std::string();
+    if (options.upgrades_only)
+        query += " -u";
+    if (options.brief)
+        query += " -b";
+    if (options.all_versions)
+        query += " -a";
+    if (options.no_hold)
+        query += " -n";
+    if (options.regex_all)
+        query += " -R";
+    if (options.security)
+        query += " --security";
+    if (options.check)
+        query += " --check";
+    if (options.format != FORMAT_TEXT)
+        query += std::string(" --format=") + format_names[options.format];
+    if (!options.arch.empty())
+        query += " --arch=" + options.arch;
+    if (!options.section.empty())
+        query += " --section=" + options.section;
+    if (!options.origin.empty())
+        query += " --origin=" + options.origin;
+    for (size_t i = 0; patterns[i]; i++)
+        query += std::string(" ") + patterns[i];
+
+    return query + "\n";
 }
 
 /**
- * \brief Generate a name to display for a given package and candidate
+ * \brief Answer a single query on a connection to the server
  *
- * This returns the name of the package (possibly qualified with architecture)
- * and if available, the name of the distribution it comes from. If the package
- * exists in multiple distributions, the distribution with the highest priority
- * is chosen.
+ * The reply consists of a line with the exit code and the size of the
+ * output, followed by the output and the error messages. If the cache
+ * needs to be reloaded, this is done first.
  *
- * \param p The package to display
- * \param c The candidate to take the distribution info from
+ * \param conn The connection
+ * \param cachefile The cache to answer from
+ * \param reload Whether the cache needs to be reloaded; cleared if the
+ *               cache is reloaded successfully
  */
-static std::string my_name(pkgCache::PkgIterator p, pkgCache::VerIterator c)
+static void answer_query(int conn, std::unique_ptr<pkgCacheFile> &cachefile, bool &reload)
 {
-    std::string name = p.FullName(true);
-    std::string my;
-    int prio = 0;
+    const Options saved_options = options;
+    std::vector<std::string> patterns;
+    std::ostringstream err;
+    OutputBuffer reply;
+    std::string line;
+    int status = 1;
+    char buf[4096];
 
-    for (auto vf = c.FileList(); c.IsGood(); c++) {
-        auto this_prio = policy->GetPriority(vf.File());
-        if (vf.File()->Flags & pkgCache::Flag::NotSource)
-            continue;
-        else if (!my.empty() && prio >= this_prio)
+    /* Read the query, a single line */
+    while (line.find('\n') == std::string::npos && line.size() < 64 * 1024) {
+        ssize_t res = read(conn, buf, sizeof(buf));
+        if (res < 0 && errno == EINTR)
             continue;
+        if (res <= 0)
+            break;
+        line.append(buf, res);
+    }
+    line.erase(std::min(line.find('\n'), line.size()));
 
-        std::string distro = find_distribution_name(vf.File());
-        if (!distro.empty()) {
-            my = name + "/" + distro;
-            prio = this_prio;
+    /* Read the preferences and sources again if they were broken */
+    if (reload || policy_incomplete)
+        reload = !open_cache(cachefile);
+
+    if (!reload && parse_query(line, patterns)) {
+        check_options(!patterns.empty());
+        build_filter_table(cachefile->GetPkgCache());
+        if (!_error->PendingError()) {
+            std::vector<const char *> args;
+            for (auto p = patterns.begin(); p != patterns.end(); p++)
+                args.push_back(p->c_str());
+            args.push_back(NULL);
+
+            if (options.check)
+                status = check_packages(err, *cachefile, args.data());
+            else
+                status = show_packages(reply, err, *cachefile, args.data());
         }
     }
-    return my.empty() ? name : my;
+
+    if (_error->PendingError())
+        status = 1;
+    _error->DumpErrors(err);
+    options = saved_options;
+    if (!reload)
+        build_filter_table(cachefile->GetPkgCache());
+
+    OutputBuffer conn_out(conn);
+    conn_out.write(std::to_string(status) + " " + std::to_string(reply.size()) + "\n");
+    conn_out.write(reply);
+    conn_out.write(err.str());
+
+    /* The client may be gone already, there is no one to report that to */
+    if (!conn_out.flush())
+        _error->Discard();
 }
 
 /**
- * \brief Returns a null output stream if APT::Show-Versions::Brief is false
- *
- * If APT::Show-Versions::Brief is true, this prints a newline characters and
- * returns a stream to /dev/null. Otherwise, it returns the stream it received
- * as an argument.
+ * \brief Check the inotify events for changes of the watched files
  */
-static std::ostream& print_only(std::ostream& in)
+static bool read_watch_events(int fd, const std::vector<std::string> &names)
 {
-    static std::ofstream nullstream("/dev/null");
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t len;
 
-    if (!_config->FindB("APT::Show-Versions::Brief"))
-        return in;
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        for (char *pos = buf; pos < buf + len;) {
+            const struct inotify_event *event = reinterpret_cast<struct inotify_event *>(pos);
+            if (event->len > 0 && std::find(names.begin(), names.end(), event->name) != names.end())
+                changed = true;
+            pos += sizeof(struct inotify_event) + event->len;
+        }
+    }
 
-    in << "\n";
-    return nullstream;
+    return changed;
 }
 
 /**
- * \brief Helper class to display a table
+ * \brief Answer queries on a UNIX socket
  *
- * This prints a table with aligned output.
+ * This keeps the cache, the policy and the tables derived from them loaded,
+ * and reloads them when the package cache or the dpkg status file changes.
+ * Queries are answered one after another.
  */
-template<size_t N> struct TablePrinter {
-    typedef std::array<std::string, N>  Columns;
-    struct Line {
-        int tag;
-        std::string s;
-        Columns l;
-    };
-    std::vector<Line> lines;
-    size_t max[N];
+static int serve(const std::string &path)
+{
+    std::unique_ptr<pkgCacheFile> cachefile;
+    struct sockaddr_un addr;
+    std::vector<std::string> names;
+    int sock, watch;
 
-    TablePrinter() {
-        for (size_t i = 0; i < N; i++)
-            max[i] = 0;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        _error->Error("Socket path %s is too long", path.c_str());
+        return 1;
     }
+    strcpy(addr.sun_path, path.c_str());
 
-    void insert(Columns &line) {
-        for (size_t i = 0; i < N; i++)
-            max[i] = line[i].size() > max[i] ? line[i].size() : max[i];
-
-        Line l = {1, "", line};
+    if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        _error->Errno("socket", "Could not create socket");
+        return 1;
+    }
+    unlink(path.c_str());
+    if (bind(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        listen(sock, 64) != 0) {
+        _error->Errno("bind", "Could not listen on %s", path.c_str());
+        return 1;
+    }
 
-        lines.push_back(l);
+    if ((watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        _error->Errno("inotify_init1", "Could not watch the cache");
+        return 1;
     }
 
-    void insert(const std::string& line) {
-        Line l = {0, line, Columns()};
-        lines.push_back(l);
+    std::string files[] = {_config->FindFile("Dir::Cache::pkgcache"),
+                           _config->FindFile("Dir::State::status")};
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        size_t slash = files[i].rfind('/');
+        if (files[i].empty() || slash == std::string::npos)
+            continue;
+        names.push_back(files[i].substr(slash + 1));
+        if (inotify_add_watch(watch, files[i].substr(0, slash + 1).c_str(),
+                              IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE) < 0)
+            _error->WarningE("inotify_add_watch", "Could not watch %s", files[i].c_str());
     }
 
-    void output() {
-        std::cout.setf(std::ios::left);
-        for (auto line = lines.begin(); line != lines.end(); line++) {
-            if (line->tag == 0) {
-                std::cout << line->s;
-            } else {
-                for (size_t i = 0; i < N; i++)
-                    std::cout << std::setw(max[i] + (i < N - 1)) << line->l[i];
-            }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    bool reload = !open_cache(cachefile);
+    _error->DumpErrors();
+
+    while (!stop_serving) {
+        struct pollfd fds[] = {{sock, POLLIN, 0}, {watch, POLLIN, 0}};
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            _error->Errno("poll", "Could not wait for queries");
+            break;
+        }
 
-            std::cout << "\n";
+        if ((fds[1].revents & POLLIN) && read_watch_events(watch, names))
+            reload = true;
+
+        if (fds[0].revents & POLLIN) {
+            int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+            if (conn < 0)
+                continue;
+
+            struct timeval timeout = {5, 0};
+            setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            answer_query(conn, cachefile, reload);
+            close(conn);
         }
     }
-};
+
+    unlink(path.c_str());
+    close(watch);
+    close(sock);
+    return _error->PendingError() ? 1 : 0;
+}
 
 /**
- * \brief Returns a dpkg Status line, for displaying purposes
+ * \brief Send a query to a server and show its reply
+ *
+ * \return The exit code sent by the server
  */
-static void describe_state(const pkgCache::PkgIterator &pkg)
+static int query_server(const std::string &path, const char **patterns)
 {
-    static const char *selections[] = {"unknown", "install", "hold",
-                                       "deinstall", "purge"};
-    static const char *installs[] = {"ok", "reinstreq", "hold",
-                                     "hold-reinstreq"};
-    static const char *currents[] = {"not-installed", "unpacked",
-                                     "half-configured", "INVALID",
-                                     "half-installed", "config-files",
-                                     "installed", "triggers-awaited",
-                                     "triggers-pending"};
+    struct sockaddr_un addr;
+    std::vector<char> reply;
+    std::string query = build_query(patterns);
+    int sock;
 
-    assert(pkg->SelectedState < sizeof(selections) / sizeof(selections[0]));
-    assert(pkg->InstState < sizeof(installs) / sizeof(installs[0]));
-    assert(pkg->CurrentState < sizeof(currents) / sizeof(currents[0]));
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        _error->Error("Socket path %s is too long", path.c_str());
+        return 1;
+    }
+    strcpy(addr.sun_path, path.c_str());
 
-    std::cout << " " << selections[pkg->SelectedState]
-              << " " << installs[pkg->InstState]
-              << " " << currents[pkg->CurrentState];
-}
+    if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        connect(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+        _error->Errno("connect", "Could not connect to %s", path.c_str());
+        return 1;
+    }
 
-/**
- * \brief Possible upgrade states
- */
-enum upgrade_state {
-    /** The package in question is not installed */
-    UPGRADE_NOT_INSTALLED,
-    /** The package is not available anymore */
-    UPGRADE_NOT_AVAIL,
-    /** The package is up-to-date */
-    UPGRADE_UPTODATE,
-    /** The installed version is not available anymore, but a downgrade */
-    UPGRADE_DOWNGRADE,
-    /** An upgrade can be performed automatically */
-    UPGRADE_AUTOMATIC,
-    /** A manual upgrade can be performed */
-    UPGRADE_MANUAL,
-};
+    {
+        OutputBuffer request(sock);
+        request.write(query);
+        if (!request.flush())
+            return 1;
+    }
+
+    bool ok = read_fd(sock, reply);
+    close(sock);
+
+    /* Terminate the reply, so the header can be parsed with sscanf() */
+    size_t total = reply.size();
+    reply.push_back('\0');
+
+    int status = 1;
+    size_t size = 0;
+    int header = 0;
+    if (!ok || sscanf(reply.data(), "%d %zu\n%n", &status, &size, &header) != 2 ||
+        header == 0 || total - header < size) {
+        _error->Error("Invalid reply from %s", path.c_str());
+        return 1;
+    }
+
+    {
+        OutputBuffer out(STDOUT_FILENO);
+        OutputBuffer err(STDERR_FILENO);
+        out.write(reply.data() + header, size);
+        err.write(reply.data() + header + size, total - header - size);
+        if (!out.flush() || !err.flush())
+            return 1;
+    }
+
+    return status;
+}
 
 /**
- * \brief Determine the upgrade state of a package
+ * \brief Read the list of root directories for --root-list
+ *
+ * The file contains one directory per line. Empty lines and lines starting
+ * with # are ignored.
  */
-static upgrade_state determine_upgradeability(const pkgCache::PkgIterator &p)
+static bool read_root_list(const std::string &path, std::vector<std::string> &roots)
 {
-    auto current = p.CurrentVer();
-    auto candidate = policy->GetCandidateVer(p);
-    auto newer = p.VersionList();
+    std::vector<char> data;
+    int fd;
 
-    if (current.end())
-        return UPGRADE_NOT_INSTALLED;
-    else if (p.VersionList()->NextVer == 0 && current.FileList()->NextFile == 0)
-        return UPGRADE_NOT_AVAIL;
-    else if (candidate->ID != current->ID)
-        return UPGRADE_AUTOMATIC;
-    else if (current.FileList()->NextFile != 0)
-        return UPGRADE_UPTODATE;
-    else if (newer.IsGood() && newer->ID != current->ID)
-        return UPGRADE_MANUAL;
-    else if (current->NextVer != 0)
-        return UPGRADE_DOWNGRADE;
+    if ((fd = open(path.c_str(), O_RDONLY | O_CLOEXEC)) < 0)
+        return _error->Errno("open", "Could not open root list %s", path.c_str());
+
+    bool ok = read_fd(fd, data);
+    close(fd);
+    if (!ok)
+        return _error->Errno("read", "Could not read root list %s", path.c_str());
 
-    __builtin_trap();
+    std::istringstream lines(std::string(data.begin(), data.end()));
+    for (std::string line; std::getline(lines, line);) {
+        size_t begin = line.find_first_not_of(" \t");
+        if (begin == std::string::npos || line[begin] == '#')
+            continue;
+
+        size_t end = line.find_last_not_of(" \t/");
+        roots.push_back(end == std::string::npos ? "/" : line.substr(begin, end - begin + 1));
+    }
+
+    return true;
 }
 
 /**
- * \brief Enable ordering for packages.
- *
- * We use that operator overload to have our APT::PackageSet instance
- * sorted.
+ * \brief Read a whole file, giving an empty string if it cannot be read
  */
-static bool operator <(const pkgCache::PkgIterator &a,
-                       const pkgCache::PkgIterator &b)
+static std::string read_file(const std::string &path)
 {
-    int value = strcmp(a.Name(), b.Name());
+    std::vector<char> data;
+    int fd;
 
-    if (unlikely(value == 0))
-        value = strcmp(a.Arch(), b.Arch());
+    if ((fd = open(path.c_str(), O_RDONLY | O_CLOEXEC)) < 0)
+        return std::string();
 
-    return value < 0;
+    bool ok = read_fd(fd, data);
+    close(fd);
+    return ok ? std::string(data.begin(), data.end()) : std::string();
 }
 
 /**
- * \brief Check whether a given suite is present in the cache
+ * \brief Point the configuration at a root directory
+ *
+ * The packaging system is initialized again, as it keeps the index of the
+ * dpkg status file it found first.
+ *
+ * \param status The location of the dpkg status file in the root
  */
-bool suite_is_in_cache(pkgCache *cache, const char *name) {
-    for (auto f = cache->FileBegin(); f != cache->FileEnd(); f++)
-            if (f->Archive && strcmp(f.Archive(), name) == 0)
-                return true;
-
-    return false;
+static bool set_root(const std::string &root, const std::string &status)
+{
+    _config->Set("Dir", root + "/");
+    _config->Set("Dir::State::status", root + status);
+    return _system->Initialize(*_config);
 }
+
 /**
- * \brief Check whether a given suite is an official one
+ * \brief Hash the sources.list and sources.list.d contents of the current root
  */
-bool suite_is_official(pkgCache::PkgFileIterator file) {
-    for (auto s = official_suites; *s; s++)
-            if (**s && file->Archive && strcmp(*s, file.Archive()) == 0)
-                return true;
+static uint64_t sources_hash()
+{
+    std::string dir = _config->FindDir("Dir::Etc::sourceparts");
+    std::vector<std::string> names;
+    uint64_t hash = fnv1a(fnv1a_basis, read_file(_config->FindFile("Dir::Etc::sourcelist")).c_str());
+    DIR *d;
 
-    return false;
+    if ((d = opendir(dir.c_str())) != NULL) {
+        for (struct dirent *ent; (ent = readdir(d)) != NULL;)
+            if (ent->d_name[0] != '.')
+                names.push_back(ent->d_name);
+        closedir(d);
+    }
+
+    std::sort(names.begin(), names.end());
+    for (auto name = names.begin(); name != names.end(); name++) {
+        hash = fnv1a(hash, name->c_str());
+        hash = fnv1a(hash, read_file(dir + *name).c_str());
+    }
+
+    return hash;
 }
 
 /**
- * \brief Implementation of parts of the --allversions option
+ * \brief Show the packages of a group of roots, in a child process
+ *
+ * The output for each root is written to a file named after the index of
+ * the root in \a dir. Errors are written to stderr directly.
+ *
+ * \return The highest exit code of all roots
  */
-static void show_all_versions(const pkgCache::PkgIterator &pkg)
+static int show_root_group(const std::vector<size_t> &group,
+                           const std::vector<std::string> &roots,
+                           const std::string &dir, const std::string &status,
+                           const char **patterns)
 {
-    TablePrinter<4> table;
+    int result = 0;
 
-    if (pkg->CurrentVer) {
-        std::cout << pkg.FullName(true) << " " << pkg.CurrentVer().VerStr();
-        describe_state(pkg);
-        std::cout << "\n";
-    } else {
-        std::cout << "Not installed\n";
+    /* The roots are what is processed in parallel */
+    options.threads = 1;
+
+    for (auto i = group.begin(); i != group.end(); i++) {
+        const std::string &root = roots[*i];
+        std::string path = dir + "/" + std::to_string(*i);
+        int code = 1;
+        int fd;
+
+        record_root = root.c_str();
+
+        if (!set_root(root, status)) {
+            _error->Error("Could not initialize the packaging system for %s", root.c_str());
+        } else if ((fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) {
+            _error->Errno("open", "Could not create %s", path.c_str());
+        } else {
+            OutputBuffer out(fd);
+            std::unique_ptr<pkgCacheFile> cachefile;
+
+            if (options.format == FORMAT_TEXT) {
+                out.write("==> ");
+                out.write(root);
+                out.write(" <==\n");
+            }
+            if (open_cache(cachefile) && !_error->PendingError())
+                code = show_packages(out, std::cerr, *cachefile, patterns);
+            if (!out.flush())
+                code = 1;
+
+            close(fd);
+        }
+
+        if (_error->PendingError()) {
+            _error->Error("Could not show the packages in %s", root.c_str());
+            code = 1;
+        }
+        _error->DumpErrors();
+        result = std::max(result, code);
     }
 
-    for (auto release = official_suites; *release; release++) {
-        if (release != official_suites && !suite_is_in_cache(pkg.Cache(), *release))
-            continue;
+    return result;
+}
 
-        bool found = false;
-        for (auto ver = pkg.VersionList(); ver.IsGood(); ver++) {
-            for (auto vf = ver.FileList(); vf.IsGood(); vf++) {
-                if (vf.File()->Flags & pkgCache::Flag::NotSource)
-                    continue;
+/**
+ * \brief Show the packages of all roots listed in a file, for --root-list
+ *
+ * Roots with the same sources.list contents are handled one after another
+ * by the same child process, which keeps the strings interned for them,
+ * but such groups are split into chunks of at most a -j-th of the roots,
+ * so that all children have work. Up to -j children run at the same time;
+ * they are forked after the
+ * configuration has been parsed, so it is not parsed again per root. The
+ * output is shown in the order of the root list.
+ *
+ * \return The highest exit code of all roots
+ */
+static int show_roots(const std::string &list_path, const char **patterns)
+{
+    std::string status = _config->Find("Dir::State::status", "/var/lib/dpkg/status");
+    std::vector<std::string> roots;
+    std::vector<std::vector<size_t> > groups;
+    std::unordered_map<uint64_t, size_t> group_index;
+    unsigned int jobs = std::max(options.threads, 1u);
+    int result = 0;
 
-                if (release == official_suites) {
-                    if (suite_is_official(vf.File()))
-                        continue;
-                } else if (strcmp(vf.File().Archive(), *release) != 0) {
-                    continue;
-                }
+    if (!read_root_list(list_path, roots))
+        return 1;
 
-                found = true;
+    size_t chunk = (roots.size() + jobs - 1) / jobs;
+    for (size_t i = 0; i < roots.size(); i++) {
+        set_root(roots[i], status);
+        auto g = group_index.insert(std::make_pair(sources_hash(), groups.size()));
+        if (g.second || groups[g.first->second].size() == chunk) {
+            g.first->second = groups.size();
+            groups.push_back(std::vector<size_t>());
+        }
+        groups[g.first->second].push_back(i);
+    }
 
-                TablePrinter<4>::Columns line = {{pkg.FullName(true), ver.VerStr(), find_distribution_name(vf.File()), std::string(vf.File().Site())}};
+    const char *tmp = getenv("TMPDIR");
+    std::string dir = std::string(tmp != NULL && *tmp != '\0' ? tmp : "/tmp") +
+                      "/apt-show-versions.XXXXXX";
+    if (mkdtemp(&dir[0]) == NULL) {
+        _error->Errno("mkdtemp", "Could not create a temporary directory");
+        return 1;
+    }
 
-                table.insert(line);
+    size_t next = 0;
+    size_t running = 0;
+    while (next < groups.size() || running > 0) {
+        if (next < groups.size() && running < jobs) {
+            pid_t pid = fork();
+            if (pid == 0)
+                _exit(show_root_group(groups[next], roots, dir, status, patterns));
+            if (pid > 0) {
+                running++;
+                next++;
+                continue;
             }
+            _error->Errno("fork", "Could not start a worker process");
+            next = groups.size();
+            if (running == 0)
+                break;
+        }
+
+        int wstatus;
+        if (wait(&wstatus) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
         }
+        running--;
+        result = std::max(result, WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 1);
+    }
 
-        if (!found && release != official_suites)
-            table.insert(std::string("No ") + *release + " version");
+    OutputBuffer out(STDOUT_FILENO);
+    for (size_t i = 0; i < roots.size(); i++) {
+        std::string path = dir + "/" + std::to_string(i);
+        std::vector<char> data;
+        int fd;
+
+        if ((fd = open(path.c_str(), O_RDONLY | O_CLOEXEC)) < 0 || !read_fd(fd, data)) {
+            _error->Error("No output for %s", roots[i].c_str());
+            result = 1;
+        } else {
+            out.write(data.data(), data.size());
+        }
+        if (fd >= 0)
+            close(fd);
+        unlink(path.c_str());
     }
+    rmdir(dir.c_str());
 
-    table.output();
+    if (!out.flush())
+        result = 1;
+    return result;
 }
 
 /**
- * \brief Shows information about upgradeability of a single package
+ * \brief Shows the timings and counters collected for --stats
  */
-static void show_upgrade_info(const pkgCache::PkgIterator &p, bool show_uninstalled)
+static void show_stats(const OutputBuffer &out)
 {
-    if ((p->CurrentVer == 0 && !show_uninstalled))
-        return;
-    if (p->SelectedState == pkgCache::State::Hold &&
-        _config->FindB("APT::Show-Versions::No-Hold", false))
+    if (!options.stats)
         return;
 
-    const upgrade_state state = determine_upgradeability(p);
+    for (size_t i = 0; i < PHASE_COUNT; i++)
+        fprintf(stderr, "%-28s %10.3f ms\n", stats_phase_names[i],
+                stats.phase_ns[i] / 1e6);
+    fprintf(stderr, "%-28s %10.3f ms (%lu calls)\n", "candidate lookups",
+            stats.candidate_ns / 1e6, stats.candidate_lookups);
+    fprintf(stderr, "%-28s %10lu\n", "index file lookups", stats.index_lookups);
+    fprintf(stderr, "%-28s %10lu\n", "files found in sources.list", stats.files_resolved);
+    fprintf(stderr, "%-28s %10lu\n", "files using their archive", stats.files_fallback);
+    fprintf(stderr, "%-28s %10lu\n", "packages visited", stats.packages_visited.load());
+    fprintf(stderr, "%-28s %10lu\n", "packages shown", stats.packages_shown.load());
+    fprintf(stderr, "%-28s %10zu\n", "bytes written", out.written());
+}
 
-    if (state < UPGRADE_AUTOMATIC && _config->FindB("APT::Show-Versions::Upgrades-Only"))
+/**
+ * \brief Shows the slowest packages collected for --profile-packages
+ */
+static void show_profile()
+{
+    if (profile.empty())
         return;
 
-    if (_config->FindB("APT::Show-Versions::All-Versions"))
-        show_all_versions(p);
-
-    auto current = p.CurrentVer();
-    auto candidate = policy->GetCandidateVer(p);
-    auto newer = p.VersionList();
-
-    if (state == UPGRADE_NOT_INSTALLED) {
-        std::cout << p.FullName(true) << " not installed\n";
-    } else if (state == UPGRADE_AUTOMATIC) {
-        print_only(std::cout << my_name(p, candidate)) << " upgradeable from " << current.VerStr() << " to " << candidate.VerStr() << "\n";
-    } else if (state == UPGRADE_MANUAL) {
-        print_only(std::cout << my_name(p, newer)) << " *manually* upgradeable from " << current.VerStr() << " to " << newer.VerStr() << "\n";
-    } else if (state == UPGRADE_NOT_AVAIL) {
-        std::cout << p.FullName(true) << " " << current.VerStr() << " installed: No available version in archive\n";
-    } else if (state == UPGRADE_UPTODATE) {
-        print_only(std::cout << my_name(p, candidate)) << " uptodate " << current.VerStr() << "\n";
-    } else if (state == UPGRADE_DOWNGRADE) {
-        print_only(std::cout << my_name(p, candidate)) << " " << current.VerStr() << " newer than version in archive\n";
-    }
+    std::sort_heap(profile.begin(), profile.end(), std::greater<ProfileEntry>());
+    fprintf(stderr, "%-40s %14s %8s %8s %8s\n", "slowest packages", cycle_unit,
+            "versions", "files", "misses");
+    for (auto e = profile.begin(); e != profile.end(); e++)
+        fprintf(stderr, "%-40s %14llu %8u %8u %8u\n", e->name.c_str(),
+                (unsigned long long) e->cycles, e->versions, e->files, e->misses);
 }
 
 /**
@@ -409,6 +3930,27 @@ static void show_help()
     std::cout << " -a,--allversions             show all versions\n";
     std::cout << " -b,--brief                   show package names only\n";
     std::cout << " -n,--no-hold                 do not show hold packages\n";
+    std::cout << " -j,--threads=?               number of threads to use, 0 for all CPUs\n";
+    std::cout << " --format=?                   output format: text, jsonl or tsv\n";
+    std::cout << " --result-cache               reuse the results of earlier runs if possible\n";
+    std::cout << " --serve=?                    answer queries on the given UNIX socket\n";
+    std::cout << " --connect=?                  send the query to the given UNIX socket\n";
+    std::cout << " --stats                      show timings and counters on stderr\n";
+    std::cout << " --since=?                    show only changes since the given state file\n";
+    std::cout << " --root-list=?                show the packages of each root listed in a file\n";
+    std::cout << " --export-snapshot=?          write the state of all installed packages to a file\n";
+    std::cout << " --from-snapshot=?            show packages from an exported snapshot\n";
+    std::cout << " --aggregate                  merge the exported snapshots given as arguments\n";
+    std::cout << " -q,--check,--quiet           only set the exit code: 0 if upgradeable, 2 if not,\n";
+    std::cout << "                              3 if not available\n";
+    std::cout << " --security                   show only upgrades from security archives\n";
+    std::cout << " --low-memory                 keep memory use independent of the package count\n";
+    std::cout << " --cache-read-only            never regenerate the package cache\n";
+    std::cout << " --cache-wait=?               seconds to wait for an outdated read-only cache\n";
+    std::cout << " --arch=?                     show only packages of the given architecture\n";
+    std::cout << " --section=?                  show only packages of the given section\n";
+    std::cout << " --origin=?                   show only packages available from the given origin\n";
+    std::cout << " --profile-packages=?         show the given number of slowest packages on stderr\n";
     std::cout << " -h,--help                    show help\n";
 }
 
@@ -427,6 +3969,27 @@ int main(int argc,const char **argv)
         {'R',"regex-all","apt::show-versions::regex-all",CommandLine::Boolean},
         {'n',"no-hold","apt::show-versions::no-hold",CommandLine::Boolean},
         {'p',"package","apt::show-versions::package",CommandLine::HasArg},
+        {'j',"threads","apt::show-versions::threads",CommandLine::HasArg},
+        {0,"format","apt::show-versions::format",CommandLine::HasArg},
+        {0,"result-cache","apt::show-versions::result-cache",CommandLine::Boolean},
+        {0,"serve","apt::show-versions::serve",CommandLine::HasArg},
+        {0,"connect","apt::show-versions::connect",CommandLine::HasArg},
+        {0,"stats","apt::show-versions::stats",CommandLine::Boolean},
+        {0,"since","apt::show-versions::since",CommandLine::HasArg},
+        {0,"root-list","apt::show-versions::root-list",CommandLine::HasArg},
+        {0,"export-snapshot","apt::show-versions::export-snapshot",CommandLine::HasArg},
+        {0,"from-snapshot","apt::show-versions::from-snapshot",CommandLine::HasArg},
+        {0,"aggregate","apt::show-versions::aggregate",CommandLine::Boolean},
+        {'q',"check","apt::show-versions::check",CommandLine::Boolean},
+        {0,"quiet","apt::show-versions::check",CommandLine::Boolean},
+        {0,"security","apt::show-versions::security",CommandLine::Boolean},
+        {0,"low-memory","apt::show-versions::low-memory",CommandLine::Boolean},
+        {0,"cache-read-only","apt::show-versions::cache-read-only",CommandLine::Boolean},
+        {0,"cache-wait","apt::show-versions::cache-wait",CommandLine::HasArg},
+        {0,"arch","apt::show-versions::arch",CommandLine::HasArg},
+        {0,"section","apt::show-versions::section",CommandLine::HasArg},
+        {0,"origin","apt::show-versions::origin",CommandLine::HasArg},
+        {0,"profile-packages","apt::show-versions::profile-packages",CommandLine::HasArg},
         {0,0,0,0}
     };
     CommandLine cmd(args, _config);
@@ -440,19 +4003,9 @@ int main(int argc,const char **argv)
         return 0;
     }
 
-    pkgInitSystem(*_config, _system);
-    pkgCacheFile cachefile;
-    pkgCache *cache = cachefile.GetPkgCache();
-
-    list = cachefile.GetSourceList();
-    policy = cachefile.GetPolicy();
-
-    if (cmd.FileList[0] && _config->FindB("apt::show-versions::no-hold")) {
-        _error->Error("Cannot specify -n|--no-hold with a package name");
-    }
-    if (!cmd.FileList[0] && _config->FindB("apt::show-versions::regex-all")) {
-        _error->Error("Cannot specify -R|--regex-all without a pattern");
-    }
+    read_options();
+    /* With --aggregate, the arguments are snapshot files */
+    check_options(cmd.FileList[0] != NULL && !options.aggregate);
 
     /* Hack backward compatibility for -p back in */
     if (!_config->Find("apt::show-versions::package").empty()) {
@@ -464,6 +4017,103 @@ int main(int argc,const char **argv)
         cmd.FileList[1] = NULL;
     }
 
+    if (!_config->Find("apt::show-versions::connect").empty()) {
+        int status = 1;
+        if (!_error->PendingError())
+            status = query_server(_config->Find("apt::show-versions::connect"), cmd.FileList);
+        _error->DumpErrors();
+        return status;
+    }
+
+    if (options.aggregate) {
+        int status = 1;
+        if (cmd.FileList[0] == NULL)
+            _error->Error("--aggregate needs at least one snapshot file");
+        if (!_error->PendingError())
+            status = aggregate_snapshots(cmd.FileList);
+        _error->DumpErrors();
+        return status;
+    }
+
+    if (!options.from_snapshot.empty()) {
+        int status = 1;
+        if (!_error->PendingError())
+            status = show_snapshot(options.from_snapshot, cmd.FileList);
+        _error->DumpErrors();
+        return status;
+    }
+
+    pkgInitSystem(*_config, _system);
+    _config->CndSet("Dir::Cache::ShowVersionsOrder", "apt-show-versions.order");
+
+    if (!_config->Find("apt::show-versions::serve").empty()) {
+        if (cmd.FileList[0])
+            _error->Error("Cannot specify --serve with a package name");
+        if (!options.since.empty())
+            _error->Error("Cannot specify --serve with --since");
+        if (!options.export_snapshot.empty())
+            _error->Error("Cannot specify --serve with --export-snapshot");
+        if (_error->PendingError()) {
+            _error->DumpErrors();
+            return 1;
+        }
+        int status = serve(_config->Find("apt::show-versions::serve"));
+        _error->DumpErrors();
+        return status;
+    }
+
+    if (!_config->Find("apt::show-versions::root-list").empty()) {
+        if (!options.since.empty())
+            _error->Error("Cannot specify --root-list with --since");
+        if (options.check)
+            _error->Error("Cannot specify --root-list with --check");
+        if (!options.export_snapshot.empty())
+            _error->Error("Cannot specify --root-list with --export-snapshot");
+        if (_error->PendingError()) {
+            _error->DumpErrors();
+            return 1;
+        }
+        int status = show_roots(_config->Find("apt::show-versions::root-list"), cmd.FileList);
+        _error->DumpErrors();
+        return status;
+    }
+
+    OutputBuffer out(STDOUT_FILENO);
+
+    /* The result cache is only used for showing all installed packages */
+    bool use_result_cache = options.result_cache && options.since.empty() && !options.check
+                            && !options.security && !options.low_memory
+                            && !options.cache_read_only
+                            && options.arch.empty() && options.section.empty()
+                            && options.origin.empty() && !options.profile
+                            && options.export_snapshot.empty()
+                            && cmd.FileList[0] == NULL
+                            && !options.all_versions
+                            && !_config->FindB("apt::show-versions::initialize-cache");
+    std::string result_key;
+    if (use_result_cache && !_error->PendingError()) {
+        std::vector<char> records;
+
+        bool loaded;
+        {
+            PhaseTimer timer(PHASE_RESULT_CACHE);
+            result_key = result_cache_key();
+            loaded = load_result_cache(result_key, records);
+        }
+        if (loaded) {
+            show_cached_records(out, records.data(), records.data() + records.size());
+            if (!out.flush()) {
+                _error->DumpErrors();
+                return 1;
+            }
+            show_stats(out);
+            return 0;
+        }
+    }
+
+    std::unique_ptr<pkgCacheFile> cachefile;
+    bool opened = open_cache(cachefile);
+
     if (_config->FindB("apt::show-versions::initialize-cache")) {
         _error->Warning("Use apt-cache gencaches instead of %s -i", argv[0]);
         if (!_error->PendingError()) {
@@ -472,50 +4122,68 @@ int main(int argc,const char **argv)
         }
     }
 
-    if (cache == NULL || _error->PendingError()) {
+    if (!opened || _error->PendingError()) {
         _error->DumpErrors();
         return 1;
     }
 
-    if (cmd.FileList[0] == NULL) {
-        std::vector<pkgCache::Group*> groups(cache->HeaderP->GroupCount);
-        for (auto p = cache->GrpBegin(); p != cache->GrpEnd(); p++)
-            groups[p->ID] = p;
-
-        std::sort(groups.begin(), groups.end(),
-                  [cache](pkgCache::Group *a, pkgCache::Group *b) {
-                    return strcmp(cache->StrP + a->Name,
-                                  cache->StrP + b->Name) < 0;
-        });
+    int status = 0;
+    if (options.check) {
+        status = check_packages(std::cerr, *cachefile, cmd.FileList);
+    } else if (!options.export_snapshot.empty()) {
+        std::vector<pkgCache::Group*> groups = sorted_groups(cachefile->GetPkgCache());
+        OutputBuffer records;
 
-        for (size_t i = 0; i < cache->HeaderP->GroupCount; i++) {
-            pkgCache::GrpIterator grp(*cache, groups[i]);
-            for (auto p = grp.PackageList(); !p.end(); p = grp.NextPkg(p))
-                show_upgrade_info(p, false);
+        scan_groups(records, cachefile->GetPkgCache(), groups, collect_groups);
+        if (!export_snapshot(options.export_snapshot,
+                             records.begin(), records.begin() + records.size())) {
+            _error->DumpErrors();
+            return 1;
         }
-    } else {
-        auto regex_all = _config->FindB("apt::show-versions::regex-all");
-        for (size_t i = 0; cmd.FileList[i]; i++) {
-            std::string pattern = cmd.FileList[i];
-            auto pkgs = APT::PackageSet::FromString(cachefile, pattern);
+    } else if (!options.since.empty()) {
+        std::vector<pkgCache::Group*> groups = sorted_groups(cachefile->GetPkgCache());
+        OutputBuffer records;
 
+        if (!load_snapshot(options.since)) {
             _error->DumpErrors();
+            return 1;
+        }
+        scan_groups(records, cachefile->GetPkgCache(), groups, since_groups);
+        if (!show_changes(out, records.begin(), records.begin() + records.size(),
+                          options.since)) {
+            _error->DumpErrors();
+            return 1;
+        }
+    } else if (use_result_cache) {
+        std::vector<pkgCache::Group*> groups = sorted_groups(cachefile->GetPkgCache());
+        OutputBuffer records;
 
-            for (auto pp = pkgs.begin(); pp != pkgs.end(); pp++)
-                show_upgrade_info(*pp, regex_all || pkgs.getConstructor() ==
-                                  APT::PackageContainerInterface::UNKNOWN);
-
-            /* If only a single package name is given, and -u is specified,
-             * we should exit with code 2.
-             */
-            if (pkgs.getConstructor() == APT::PackageContainerInterface::UNKNOWN
-                && cmd.FileList[1] == NULL
-                && _config->FindB("apt::show-versions::upgrades-only")
-                && pattern.find('*') == std::string::npos
-                && (pkgs.begin() == pkgs.end() ||
-                    determine_upgradeability(*pkgs.begin()) < UPGRADE_AUTOMATIC))
-                return 2;
+        scan_groups(records, cachefile->GetPkgCache(), groups, collect_groups);
+        /* Only store the results if no input changed while opening the
+         * cache, such as the cache itself being rebuilt, and if there
+         * were no errors, such as while reading the preferences */
+        {
+            PhaseTimer timer(PHASE_RESULT_CACHE);
+            if (!_error->PendingError() && result_key == result_cache_key() &&
+                !save_result_cache(result_key, records))
+                _error->DumpErrors();
         }
+        show_cached_records(out, records.begin(), records.begin() + records.size());
+    } else {
+        status = show_packages(out, std::cerr, *cachefile, cmd.FileList);
+    }
+
+    if (!out.flush()) {
+        _error->DumpErrors();
+        return 1;
     }
 
+    show_stats(out);
+    show_profile();
+
+    /* Errors reading the sources or the preferences on first use, and
+     * warnings such as the one about an outdated read-only cache */
+    bool failed = _error->PendingError();
+    _error->DumpErrors();
+    return failed ? 1 : status;
 }
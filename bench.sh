@@ -0,0 +1,167 @@
+#!/bin/sh
+# Benchmark apt-show-versions against a synthetic package cache
+#
+# Usage: bench.sh [apt-show-versions binary]
+#
+# The size of the generated tree is controlled by the environment variables
+# BENCH_PACKAGES (number of installed packages), BENCH_SOURCES (number of
+# repositories), BENCH_SUITES (number of suites per repository) and
+# BENCH_VERSIONS (number of versions of each package per suite). The tree is
+# generated in BENCH_DIR, a temporary directory by default.
+#
+# For each mode, the wall time, the number of system calls (if strace is
+# available) and the peak RSS (if GNU time is available) are reported.
+
+set -e
+
+ASV=${1:-./apt-show-versions}
+PACKAGES=${BENCH_PACKAGES:-20000}
+SOURCES=${BENCH_SOURCES:-2}
+SUITES=${BENCH_SUITES:-3}
+VERSIONS=${BENCH_VERSIONS:-2}
+ARCH=amd64
+
+case $ASV in
+    */*) ;;
+    *) ASV=./$ASV ;;
+esac
+
+if [ -z "$BENCH_DIR" ]; then
+    BENCH_DIR=$(mktemp -d "${TMPDIR:-/tmp}/asv-bench.XXXXXX")
+    trap 'rm -rf "$BENCH_DIR"' EXIT
+fi
+
+ROOT=$BENCH_DIR/root
+LISTS=$ROOT/var/lib/apt/lists
+
+# Generates the dpkg status file, the sources.list and the lists directory
+generate() {
+    rm -rf "$ROOT"
+    mkdir -p "$ROOT/var/lib/dpkg" "$LISTS/partial" "$ROOT/var/cache/apt" \
+        "$ROOT/etc/apt/sources.list.d" "$ROOT/etc/apt/preferences.d"
+
+    awk -v n="$PACKAGES" -v arch="$ARCH" 'BEGIN {
+        for (i = 0; i < n; i++) {
+            print "Package: bench-pkg-" i
+            print "Status: install ok installed"
+            print "Priority: optional"
+            print "Section: misc"
+            print "Maintainer: Benchmark <bench@example.invalid>"
+            print "Architecture: " arch
+            print "Version: 1.0-1"
+            print "Description: synthetic package " i
+            print ""
+        }
+    }' > "$ROOT/var/lib/dpkg/status"
+
+    : > "$ROOT/etc/apt/sources.list"
+    suites=$(echo stable testing unstable experimental oldstable \
+                  proposed-updates stable-updates | cut -d' ' -f1-"$SUITES")
+    s=0
+    while [ "$s" -lt "$SOURCES" ]; do
+        host=bench$s.example.invalid
+        for suite in $suites; do
+            echo "deb http://$host/debian $suite main" \
+                >> "$ROOT/etc/apt/sources.list"
+            prefix=$LISTS/${host}_debian_dists_${suite}
+            cat > "${prefix}_Release" <<EOF
+Origin: Bench$s
+Label: Bench$s
+Suite: $suite
+Codename: bench-$suite
+Architectures: $ARCH
+Components: main
+EOF
+            # Each source carries every other package, newer ones for the
+            # later suites, so that there is something to upgrade.
+            awk -v n="$PACKAGES" -v v="$VERSIONS" -v arch="$ARCH" \
+                -v src="$s" -v sources="$SOURCES" -v suite="$suite" 'BEGIN {
+                rank = (suite == "stable") ? 0 : (suite == "testing") ? 1 : 2
+                for (i = src; i < n; i += sources) {
+                    for (j = 0; j < v; j++) {
+                        print "Package: bench-pkg-" i
+                        print "Priority: optional"
+                        print "Section: misc"
+                        print "Maintainer: Benchmark <bench@example.invalid>"
+                        print "Architecture: " arch
+                        print "Version: 1." rank "-" (j + 1)
+                        print "Filename: pool/main/b/bench-pkg-" i ".deb"
+                        print "Size: 1024"
+                        print "Description: synthetic package " i
+                        print ""
+                    }
+                }
+            }' > "${prefix}_main_binary-${ARCH}_Packages"
+        done
+        s=$((s + 1))
+    done
+}
+
+# Runs apt-show-versions on the generated tree, prefixed by $WRAP, and
+# aborts the benchmark if it fails (2 only means nothing is upgradeable)
+run() {
+    status=0
+    $WRAP "$ASV" -o Dir="$ROOT/" \
+        -o Dir::State::status="$ROOT/var/lib/dpkg/status" \
+        -o APT::Architecture="$ARCH" "$@" > /dev/null 2> "$BENCH_DIR/stderr" ||
+        status=$?
+    case $status in
+        0|2) ;;
+        *)
+            echo "$ASV $* failed with exit code $status:" >&2
+            cat "$BENCH_DIR/stderr" >&2
+            exit 1
+            ;;
+    esac
+}
+
+# Runs one mode and prints its line of the report
+measure() {
+    name=$1
+    shift
+
+    WRAP=
+    start=$(date +%s.%N)
+    run "$@"
+    end=$(date +%s.%N)
+    wall=$(echo "$start $end" | awk '{ printf "%.3f", $2 - $1 }')
+
+    rss=-
+    if [ -x /usr/bin/time ] &&
+       /usr/bin/time -f %M -o /dev/null true > /dev/null 2>&1; then
+        WRAP="/usr/bin/time -f %M -o $BENCH_DIR/time"
+        run "$@"
+        rss=$(tail -n 1 "$BENCH_DIR/time")
+    fi
+
+    syscalls=-
+    if command -v strace > /dev/null 2>&1; then
+        WRAP="strace -f -o $BENCH_DIR/strace"
+        run "$@"
+        syscalls=$(grep -v -c -e 'resumed>' -e '^[0-9]* *+++' -e '^[0-9]* *---' \
+                   "$BENCH_DIR/strace" || true)
+    fi
+
+    printf '%-10s %10s %12s %12s\n' "$name" "$wall" "$syscalls" "$rss"
+}
+
+echo "Generating $PACKAGES packages, $SOURCES sources, $SUITES suites," \
+     "$VERSIONS versions in $BENCH_DIR"
+generate
+
+# The first run builds the binary cache, which is not what we measure
+WRAP=
+run
+
+names=$(awk -v n="$PACKAGES" 'BEGIN {
+    for (i = 0; i < n && i < 200; i++)
+        printf "bench-pkg-%d ", i * int(n / 200 > 1 ? n / 200 : 1)
+}')
+
+printf '%-10s %10s %12s %12s\n' mode "wall (s)" syscalls "RSS (KB)"
+measure all
+measure upgrades -u
+measure allvers -a
+# shellcheck disable=SC2086
+measure names $names
+measure regex -R '^bench-pkg-1.*'